@@ -4,6 +4,8 @@
  */
 
 #include "ebson11.h"
+#include "filter.h"
+#include "delta.h"
 #include <fstream>
 #include <string>
 #include <iterator>
@@ -49,6 +51,12 @@ void addDoc(const pt::ptree& pt, ebson11::Encoder& enc)
 			addDoc(child.second, enc);
 		else if (child.first == "int32")
 			enc.encode_int32(boost::lexical_cast<int32_t>(value), name);
+		else if (child.first == "int64")
+			enc.encode_int64(boost::lexical_cast<int64_t>(value), name);
+		else if (child.first == "datetime")
+			enc.encode_datetime(boost::lexical_cast<int64_t>(value), name);
+		else if (child.first == "null")
+			enc.encode_null(name);
 		else if (child.first == "bool")
 			enc.encode_bool(boost::lexical_cast<bool>(value), name);
 		else if (child.first == "double")
@@ -60,6 +68,20 @@ void addDoc(const pt::ptree& pt, ebson11::Encoder& enc)
 	}
 }
 
+volatile size_t g_perfSink = 0;
+
+/** @brief Keeps the compiler from dropping the encoding being measured: the size goes into
+ * a volatile and the bytes are treated as read by an opaque barrier.
+ */
+template<typename Buf>
+void consume(const Buf& buf)
+{
+	g_perfSink += buf.size();
+#ifdef __GNUC__
+	asm volatile("" : : "r"(buf.begin()) : "memory");
+#endif
+}
+
 void perfTest()
 {
 	std::function<void ()> funcs[]
@@ -76,7 +98,7 @@ void perfTest()
 			enc.encode_int32(100, "test");
 			enc.encode_int32(200, "rest");
 			enc.encode_string("this is a dumb and long string", "strname");
-			enc.finalize();
+			consume(enc.finalize());
 		},
 		[] () -> void
 		{
@@ -107,6 +129,24 @@ void perfTest()
 			for (size_t i = 0; i < 1000; ++i)
 				enc.document_end();
 			enc.finalize();
+		},
+		[] () -> void
+		{
+			ebson11::SmallEncoder enc;
+			enc.encode_int32(100, "test");
+			enc.encode_int32(200, "rest");
+			enc.encode_string("this is a dumb and long string", "strname");
+			consume(enc.finalize());
+		},
+		[] () -> void
+		{
+			ebson11::Encoder enc;
+			for (size_t i = 0; i < 1000; ++i)
+			{
+				enc.encode_objectid(ebson11::ObjectId::generate(), "_id");
+				enc.encode_int64(1LL << 40, "big");
+			}
+			enc.finalize();
 		}
 	};
 
@@ -120,11 +160,180 @@ void perfTest()
 		const auto end = std::chrono::system_clock::now();
 
 		std::cout << "got " << iter << " iterations in "
-				<< std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+				<< std::chrono::duration<double, std::milli>(end - start).count()
+				<< " ms" << std::endl;
+	}
+}
+
+// \em subdocs pairs of an int32 and a subdocument with a string and a double
+template<typename Enc>
+void encodeSubdocs(Enc& enc, size_t subdocs)
+{
+	enc.restart();
+	for (size_t i = 0; i < subdocs; ++i)
+	{
+		enc.encode_int32(i, "test");
+		ebson11::DocumentGuardT<Enc> guard(enc, false, "sub");
+		guard.encode_string("this is a dumb and long string", "strname");
+		guard.encode_double(i * 0.5, "d");
+	}
+}
+
+void hashPerfTest()
+{
+	std::cout << "testing hashing performance..." << std::endl;
+
+	ebson11::Encoder plain;
+	ebson11::HashingEncoder hashing;
+	for (size_t subdocs : { 4, 200, 20000, 200000 })
+	{
+		const size_t iter = std::max<size_t>(4, 4000000 / subdocs);
+		ebson11::Digest128 digest;
+		size_t bytes = 0;
+
+		const auto start = std::chrono::system_clock::now();
+		for (size_t i = 0; i < iter; ++i)
+		{
+			encodeSubdocs(hashing, subdocs);
+			consume(hashing.finalize(digest));
+			g_perfSink += digest.lo;
+		}
+		const auto mid = std::chrono::system_clock::now();
+
+		for (size_t i = 0; i < iter; ++i)
+		{
+			encodeSubdocs(plain, subdocs);
+			const auto& buf = plain.finalize();
+			bytes = buf.size();
+			consume(buf);
+			g_perfSink += ebson11::hash_bytes(buf.begin(), buf.size()).lo;
+		}
+		const auto end = std::chrono::system_clock::now();
+
+		std::cout << bytes << " bytes doc: " << iter << " HashingEncoder runs in "
+				<< std::chrono::duration<double, std::milli>(mid - start).count()
+				<< " ms, Encoder + hash_bytes() in "
+				<< std::chrono::duration<double, std::milli>(end - mid).count()
 				<< " ms" << std::endl;
 	}
 }
 
+void filterPerfTest()
+{
+	const size_t docsCount = 100000;
+	std::vector<ebson11::Encoder::BufType_t> bufs(docsCount);
+	std::vector<ebson11::DocumentView> docs;
+	for (size_t i = 0; i < docsCount; ++i)
+	{
+		ebson11::Encoder enc(256);
+		enc.encode_int32(i, "id");
+		enc.encode_string("this is a dumb and long string", "strname");
+		enc.encode_double(i % 1000 / 10.0, "score");
+		enc.encode_bool(i % 2, "flag");
+		enc.document_start(false, "doc");
+		enc.encode_string(i % 20 ? "other" : "typical", "kind");
+		enc.document_end();
+		enc.finalize(bufs[i]);
+		docs.emplace_back(bufs[i].begin(), bufs[i].size());
+	}
+
+	const ebson11::Filter filters[]
+	{
+		ebson11::Filter(ebson11::Query().eq("id", 50000)),
+		ebson11::Filter(ebson11::Query().range("score", 10, 15).eq("flag", true)),
+		ebson11::Filter(ebson11::Query().eq("doc.kind", "typical").exists("missing", false))
+	};
+
+	std::cout << "testing filter performance..." << std::endl;
+	const size_t iter = 100;
+	std::vector<uint32_t> selected;
+	for (const auto& f : filters)
+	{
+		size_t matched = 0;
+		const auto start = std::chrono::system_clock::now();
+		for (size_t i = 0; i < iter; ++i)
+		{
+			selected.clear();
+			matched += f.select(docs, selected);
+		}
+		const auto end = std::chrono::system_clock::now();
+
+		const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+		std::cout << "filtered " << iter * docsCount << " docs (" << matched / iter << " matched per pass) in "
+				<< ms << " ms, " << iter * docsCount / (ms ? ms : 1) << " docs/ms" << std::endl;
+	}
+}
+
+// a record of 100 subdocuments with 10 fields each and a log array, \em edited fields out of
+// every 1000 carry a different value, the log has \em appended extra entries
+void encodeRecord(ebson11::Encoder& enc, size_t edited, size_t appended)
+{
+	const char *names[] = { "f0", "f1", "f2", "f3", "f4", "f5", "f6", "f7", "f8", "f9" };
+
+	enc.restart();
+	enc.encode_int32(12345, "_id");
+	for (size_t d = 0; d < 100; ++d)
+	{
+		ebson11::DocumentGuard guard(enc, false, ("doc" + std::to_string(d)).c_str());
+		for (size_t f = 0; f < 10; ++f)
+		{
+			const size_t n = d * 10 + f;
+			const bool changed = n * 7919 % 1000 < edited;
+			if (f % 2)
+				enc.encode_string(changed ? "some changed string" : "some typical string", names[f]);
+			else
+				enc.encode_int32(changed ? -n : n, names[f]);
+		}
+	}
+
+	ebson11::DocumentGuard log(enc, true, "log");
+	for (size_t i = 0; i < 100 + appended; ++i)
+		log.encode_int32(i);
+}
+
+void deltaPerfTest()
+{
+	std::cout << "testing delta performance..." << std::endl;
+
+	ebson11::Encoder oldEnc;
+	encodeRecord(oldEnc, 0, 0);
+	const auto oldBuf = oldEnc.finalize().to_std_vector();
+	const ebson11::DocumentView oldDoc(&oldBuf[0], oldBuf.size());
+
+	const size_t iter = 10000;
+	for (size_t edited : { 10, 100, 500 })
+	{
+		ebson11::Encoder newEnc;
+		encodeRecord(newEnc, edited, 5);
+		const auto newBuf = newEnc.finalize().to_std_vector();
+		const ebson11::DocumentView newDoc(&newBuf[0], newBuf.size());
+
+		std::vector<uint8_t> delta;
+		const auto start = std::chrono::system_clock::now();
+		for (size_t i = 0; i < iter; ++i)
+		{
+			delta.clear();
+			ebson11::diff_documents(oldDoc, newDoc, delta);
+		}
+		const auto mid = std::chrono::system_clock::now();
+
+		std::vector<uint8_t> patched;
+		for (size_t i = 0; i < iter; ++i)
+		{
+			patched.clear();
+			ebson11::patch_document(oldDoc, delta, patched);
+		}
+		const auto end = std::chrono::system_clock::now();
+
+		std::cout << edited / 10.0 << "% edited: " << newBuf.size() << " bytes doc, "
+				<< delta.size() << " bytes delta, " << iter << " diffs in "
+				<< std::chrono::duration_cast<std::chrono::milliseconds>(mid - start).count()
+				<< " ms, " << iter << " patches in "
+				<< std::chrono::duration_cast<std::chrono::milliseconds>(end - mid).count()
+				<< " ms" << (patched == newBuf ? "" : " (MISMATCH)") << std::endl;
+	}
+}
+
 #ifndef WITHOUT_MONGO
 void mongoTest()
 {
@@ -196,7 +405,7 @@ void mongoTest()
 		const auto end = std::chrono::system_clock::now();
 
 		std::cout << "got " << iter << " iterations in "
-				<< std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()
+				<< std::chrono::duration<double, std::milli>(end - start).count()
 				<< " ms" << std::endl;
 	}
 }
@@ -253,6 +462,9 @@ int main(int argc, char **argv)
 	}
 
 	perfTest();
+	hashPerfTest();
+	filterPerfTest();
+	deltaPerfTest();
 
 #ifndef WITHOUT_MONGO
 	mongoTest();
@@ -0,0 +1,347 @@
+/**********************************************************************
+ * eBSON11 — BSON encoder in C++11.
+ *
+ * Copyright (C) 2013  Georg Rudoy		<georg@barzer.net>
+ * Copyright (C) 2013  Andre Yanpolsky	<andre@barzer.net>
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+
+namespace ebson11
+{
+namespace detail
+{
+	inline int32_t load_int32(const uint8_t *p)
+	{
+		int32_t r;
+		std::memcpy(&r, p, sizeof(r));
+		return r;
+	}
+
+	inline int64_t load_int64(const uint8_t *p)
+	{
+		int64_t r;
+		std::memcpy(&r, p, sizeof(r));
+		return r;
+	}
+
+	inline double load_double(const uint8_t *p)
+	{
+		double r;
+		std::memcpy(&r, p, sizeof(r));
+		return r;
+	}
+
+	/** @brief Returns the size of a value of type \em typeId starting at \em p.
+	 *
+	 * Returns -1 if the type is unknown or the value doesn't fit before \em end.
+	 */
+	inline ptrdiff_t value_size(uint8_t typeId, const uint8_t *p, const uint8_t *end)
+	{
+		const ptrdiff_t avail = end - p;
+		ptrdiff_t sz = -1;
+
+		switch (typeId)
+		{
+		case 0x06:	// undefined
+		case 0x0A:	// null
+		case 0x7F:	// max key
+		case 0xFF:	// min key
+			return 0;
+		case 0x08:
+			sz = 1;
+			break;
+		case 0x10:
+			sz = 4;
+			break;
+		case 0x01:
+		case 0x09:
+		case 0x11:
+		case 0x12:
+			sz = 8;
+			break;
+		case 0x07:
+			sz = 12;
+			break;
+		case 0x13:
+			sz = 16;
+			break;
+		case 0x02:	// string
+		case 0x0D:	// javascript code
+		case 0x0E:	// symbol
+			if (avail < 5)
+				return -1;
+			sz = load_int32(p);
+			if (sz < 1 || sz > avail - 4 || p[4 + sz - 1])
+				return -1;
+			sz += 4;
+			break;
+		case 0x03:
+		case 0x04:
+		case 0x0F:	// code with scope
+			if (avail < 5)
+				return -1;
+			sz = load_int32(p);
+			if (sz < 5 || sz > avail || (typeId != 0x0F && p[sz - 1]))
+				return -1;
+			break;
+		case 0x05:
+			if (avail < 5)
+				return -1;
+			sz = load_int32(p);
+			if (sz < 0 || sz > avail - 5)
+				return -1;
+			sz += 5;
+			break;
+		case 0x0B:	// regex: two cstrings
+			{
+				const void *e1 = std::memchr(p, 0, avail);
+				if (!e1)
+					return -1;
+				const auto p2 = static_cast<const uint8_t*>(e1) + 1;
+				const void *e2 = std::memchr(p2, 0, end - p2);
+				if (!e2)
+					return -1;
+				return static_cast<const uint8_t*>(e2) + 1 - p;
+			}
+		case 0x0C:	// db pointer: string + 12 bytes
+			if (avail < 5)
+				return -1;
+			sz = load_int32(p);
+			if (sz < 1 || sz > avail - 16)
+				return -1;
+			sz += 16;
+			break;
+		default:
+			return -1;
+		}
+
+		return sz <= avail ? sz : -1;
+	}
+} // namespace detail
+
+class DocumentView;
+
+/** @brief A single element of an encoded document: type, name and value bytes.
+ *
+ * Elements point into the document buffer and are only valid as long as it is.
+ * A default-constructed element is invalid and converts to false, that's what lookups
+ * return for missing fields.
+ */
+class Element
+{
+	const uint8_t *d_raw = nullptr;
+	const uint8_t *d_value = nullptr;
+	size_t d_valueSize = 0;
+public:
+	Element() {}
+
+	/** @brief Parses the element starting at \em p, \em last points at the terminating
+	 * zero of the enclosing document.
+	 *
+	 * Returns false and leaves the element untouched if the bytes at \em p don't form an
+	 * element which fits into the document.
+	 */
+	bool parse(const uint8_t *p, const uint8_t *last)
+	{
+		if (p >= last || !*p)
+			return false;
+
+		const void *nameEnd = std::memchr(p + 1, 0, last - p - 1);
+		if (!nameEnd)
+			return false;
+
+		const auto value = static_cast<const uint8_t*>(nameEnd) + 1;
+		const ptrdiff_t sz = detail::value_size(*p, value, last);
+		if (sz < 0)
+			return false;
+
+		d_raw = p;
+		d_value = value;
+		d_valueSize = sz;
+		return true;
+	}
+
+	explicit operator bool() const { return d_raw; }
+
+	uint8_t type() const { return *d_raw; }
+	const char* name() const { return reinterpret_cast<const char*>(d_raw + 1); }
+	size_t name_size() const { return d_value - d_raw - 2; }
+
+	// the whole element including the type byte and the name
+	const uint8_t* raw() const { return d_raw; }
+	size_t raw_size() const { return d_value + d_valueSize - d_raw; }
+
+	const uint8_t* value() const { return d_value; }
+	size_t value_size() const { return d_valueSize; }
+
+	int32_t as_int32() const { return detail::load_int32(d_value); }
+	int64_t as_int64() const { return detail::load_int64(d_value); }
+	double as_double() const { return detail::load_double(d_value); }
+	bool as_bool() const { return *d_value; }
+
+	// string payload without the terminating zero
+	const char* string_data() const { return reinterpret_cast<const char*>(d_value + 4); }
+	size_t string_size() const { return d_valueSize - 5; }
+
+	inline DocumentView as_document() const;
+};
+
+/** @brief A read-only view of an encoded document.
+ *
+ * The view doesn't copy or validate the whole document upfront: elements are parsed
+ * while iterating, and iteration stops at the first malformed element.
+ */
+class DocumentView
+{
+	const uint8_t *d_begin = nullptr;
+	const uint8_t *d_last = nullptr;	// the terminating zero
+public:
+	DocumentView() {}
+
+	/** @brief Creates a view of the document at \em data, \em size being the number of
+	 * bytes available there.
+	 *
+	 * The view is invalid if the document header doesn't fit into \em size bytes.
+	 */
+	DocumentView(const uint8_t *data, size_t size)
+	{
+		if (size < 5)
+			return;
+
+		const int32_t sz = detail::load_int32(data);
+		if (sz < 5 || static_cast<size_t>(sz) > size || data[sz - 1])
+			return;
+
+		d_begin = data;
+		d_last = data + sz - 1;
+	}
+
+	bool valid() const { return d_begin; }
+
+	const uint8_t* data() const { return d_begin; }
+	size_t size() const { return d_begin ? d_last - d_begin + 1 : 0; }
+
+	class iterator
+	{
+		const uint8_t *d_pos;
+		const uint8_t *d_last;
+		Element d_cur;
+
+		void parse()
+		{
+			if (!d_cur.parse(d_pos, d_last))
+				d_pos = d_last;
+		}
+	public:
+		iterator(const uint8_t *pos, const uint8_t *last)
+		: d_pos(pos)
+		, d_last(last)
+		{
+			parse();
+		}
+
+		const Element& operator*() const { return d_cur; }
+		const Element* operator->() const { return &d_cur; }
+
+		iterator& operator++()
+		{
+			d_pos += d_cur.raw_size();
+			parse();
+			return *this;
+		}
+
+		bool operator==(const iterator& other) const { return d_pos == other.d_pos; }
+		bool operator!=(const iterator& other) const { return d_pos != other.d_pos; }
+	};
+
+	iterator begin() const { return d_begin ? iterator(d_begin + 4, d_last) : end(); }
+	iterator end() const { return iterator(d_last, d_last); }
+
+	/** @brief Returns the element starting at \em offset bytes from the start of the
+	 * document.
+	 *
+	 * The offset should be one previously obtained from an element of this or a
+	 * similarly shaped document. The result is invalid unless an element of this document
+	 * starts exactly there: the preceding elements are stepped over by their sizes, so
+	 * bytes inside a string or binary value which happen to look like an element are never
+	 * returned.
+	 */
+	Element at_offset(size_t offset) const
+	{
+		if (offset < 4 || offset >= size())
+			return Element();
+
+		const uint8_t *target = d_begin + offset;
+		for (auto it = begin(), last = end(); it != last; ++it)
+			if (it->raw() >= target)
+				return it->raw() == target ? *it : Element();
+		return Element();
+	}
+
+	Element find(const char *name, size_t nameSize) const
+	{
+		for (const auto& e : *this)
+			if (e.name_size() == nameSize && !std::memcmp(e.name(), name, nameSize))
+				return e;
+		return Element();
+	}
+
+	Element find(const char *name) const { return find(name, std::strlen(name)); }
+
+	/** @brief Looks up a dotted path like "a.b.c", descending into nested documents
+	 * and arrays.
+	 */
+	Element find_path(const char *path) const
+	{
+		DocumentView doc = *this;
+		for (;;)
+		{
+			const char *dot = std::strchr(path, '.');
+			const size_t len = dot ? dot - path : std::strlen(path);
+
+			const Element e = doc.find(path, len);
+			if (!dot || !e)
+				return e;
+			if (e.type() != 0x03 && e.type() != 0x04)
+				return Element();
+
+			doc = e.as_document();
+			path = dot + 1;
+		}
+	}
+};
+
+inline DocumentView Element::as_document() const
+{
+	return DocumentView(d_value, d_valueSize);
+}
+} // namespace ebson11
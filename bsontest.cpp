@@ -1,5 +1,16 @@
 #include "ebson11.h"
+#include "projection.h"
+#include "flushpipeline.h"
+#include "delta.h"
+#include "compare.h"
+#include "filter.h"
+#include <limits>
+#include <functional>
+#include <random>
+#include <thread>
+#include <unistd.h>
 #include <sstream>
+#include <algorithm>
 
 namespace {
 
@@ -36,6 +47,658 @@ void encode_sample(ebson11::Encoder& encoder)
     }
 }
 
+int failures = 0;
+
+void check(bool ok, const char* what)
+{
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+void test_hashing()
+{
+    // {ab: -1} and {ab: 7} differ by a multiple of 2^61-1 in their value word
+    ebson11::HashingEncoder a, b;
+    ebson11::Digest128 da, db;
+
+    a.restart();
+    a.encode_int64(-1, "ab");
+    const auto& bufA = a.finalize(da);
+    check(da == ebson11::hash_bytes(bufA.begin(), bufA.size()), "incremental digest equals hash_bytes");
+
+    b.restart();
+    b.encode_int64(7, "ab");
+    const auto& bufB = b.finalize(db);
+    check(db == ebson11::hash_bytes(bufB.begin(), bufB.size()), "incremental digest equals hash_bytes");
+    check(da != db, "{ab: -1} and {ab: 7} hash differently");
+
+    // nested documents exercise the size placeholder patching
+    a.restart();
+    a.encode_int32(150, "int_field");
+    {
+        ebson11::DocumentGuardT<ebson11::HashingEncoder> nested(a, false, "nested_obj");
+        a.encode_string("My Name", "name");
+
+        ebson11::DocumentGuardT<ebson11::HashingEncoder> ints(a, true, "ints");
+        for (int i = 0; i < 10; ++i)
+            ints.encode_int32(i);
+    }
+    const auto& bufN = a.finalize(da);
+    check(da == ebson11::hash_bytes(bufN.begin(), bufN.size()), "nested document digest equals hash_bytes");
+
+    // subdocuments growing past the unfolded tail get their sizes patched into already
+    // folded blocks, the name lengths vary to place them at every offset within a word
+    a.restart();
+    for (int d = 0; d < 8; ++d)
+    {
+        const std::string name(d + 1, 'n');
+        ebson11::DocumentGuardT<ebson11::HashingEncoder> outer(a, false, name.c_str());
+        for (int i = 0; i < 500; ++i)
+            outer.encode_int64(-i, "v");
+        ebson11::DocumentGuardT<ebson11::HashingEncoder> inner(a, true, name.c_str());
+        for (int i = 0; i < 500; ++i)
+            inner.encode_string("some typical string");
+    }
+    const auto& bufL = a.finalize(da);
+    check(da == ebson11::hash_bytes(bufL.begin(), bufL.size()), "large nested document digest equals hash_bytes");
+}
+
+void test_projection_hints()
+{
+    // the second document's binary value contains bytes looking like {id: 42} right where
+    // the first document's id element was
+    ebson11::Encoder first, second;
+    const char shortBin[] = { 1, 2, 3 };
+    first.restart();
+    first.encode_binary(shortBin, sizeof(shortBin), 0, "s");
+    first.encode_int32(1, "id");
+
+    const char trickyBin[] = { 1, 1, 1, 0x10, 'i', 'd', 0, 0x2a, 0, 0, 0 };
+    second.restart();
+    second.encode_binary(trickyBin, sizeof(trickyBin), 0, "s");
+    second.encode_int32(7, "id");
+
+    const auto& b1 = first.finalize();
+    const auto& b2 = second.finalize();
+    std::vector<ebson11::DocumentView> docs { { b1.begin(), b1.size() }, { b2.begin(), b2.size() } };
+
+    ebson11::Projection proj;
+    proj.add_column("id", ebson11::ColumnType::Int32);
+    std::vector<ebson11::Column> out;
+    proj.run(docs, out);
+    check(out[0].ints[0] == 1 && out[0].ints[1] == 7, "projection hints only land on element boundaries");
+}
+
+// counts the complete documents in what the pipeline wrote, 0 if anything is left over
+size_t count_documents(const std::vector<uint8_t>& bytes)
+{
+    size_t count = 0;
+    for (size_t pos = 0; pos < bytes.size(); ++count) {
+        const ebson11::DocumentView doc(&bytes[pos], bytes.size() - pos);
+        if (!doc.valid() || doc.find("seq").as_int32() < 0)
+            return 0;
+        pos += doc.size();
+    }
+    return count;
+}
+
+// pushes producers * perProducer documents into a pipeline writing to fd
+ebson11::FlushPipeline::Stats run_pipeline(int fd, size_t producers, size_t perProducer,
+        const ebson11::FlushPipeline::Policy& policy)
+{
+    ebson11::FlushPipeline pipeline(fd, policy);
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < producers; ++t)
+        threads.emplace_back([&pipeline, t, perProducer] {
+            ebson11::Encoder encoder;
+            for (size_t i = 0; i < perProducer; ++i) {
+                encoder.restart();
+                encoder.encode_int32(static_cast<int32_t>(t * perProducer + i), "seq");
+                encoder.encode_string("some typical string", "strname");
+                pipeline.push(encoder);
+            }
+        });
+    for (auto& t : threads)
+        t.join();
+
+    pipeline.flush();
+    return pipeline.stats();
+}
+
+void test_flush_pipeline()
+{
+    const size_t producers = 4, perProducer = 5000;
+
+    ebson11::FlushPipeline::Policy policy;
+    policy.batchBytes = 1024;
+    policy.maxQueuedBytes = 4096;
+
+    // pipe: a reader thread drains it while the producers push
+    int fds[2];
+    check(!pipe(fds), "pipe()");
+    std::vector<uint8_t> received;
+    std::thread reader([&received, &fds] {
+        uint8_t chunk[4096];
+        for (ssize_t n; (n = read(fds[0], chunk, sizeof(chunk))) > 0; )
+            received.insert(received.end(), chunk, chunk + n);
+    });
+
+    const auto pipeStats = run_pipeline(fds[1], producers, perProducer, policy);
+    close(fds[1]);
+    reader.join();
+    close(fds[0]);
+
+    check(pipeStats.docsPushed == producers * perProducer, "pipe: all documents pushed");
+    check(pipeStats.docsWritten == pipeStats.docsPushed && !pipeStats.writeErrors, "pipe: all documents written");
+    check(pipeStats.maxQueuedBytes <= policy.maxQueuedBytes, "pipe: maxQueuedBytes is not exceeded");
+    check(count_documents(received) == pipeStats.docsPushed, "pipe: reader got every document complete");
+
+    // file: read back once the pipeline is done
+    FILE* file = tmpfile();
+    check(file != nullptr, "tmpfile()");
+    if (!file)
+        return;
+
+    const auto fileStats = run_pipeline(fileno(file), producers, perProducer, policy);
+    std::vector<uint8_t> stored(fileStats.bytesWritten);
+    rewind(file);
+    check(fread(stored.data(), 1, stored.size(), file) == stored.size(), "file: read back");
+    fclose(file);
+
+    check(fileStats.docsWritten == producers * perProducer && !fileStats.writeErrors, "file: all documents written");
+    check(count_documents(stored) == fileStats.docsPushed, "file: every document complete");
+
+    // flush() returns while other threads keep the queue from ever draining: a slow
+    // reader keeps the writer behind the producers
+    int slow[2];
+    check(!pipe(slow), "pipe()");
+    std::thread slowReader([&slow] {
+        uint8_t chunk[4096];
+        while (read(slow[0], chunk, sizeof(chunk)) > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    });
+    {
+        ebson11::FlushPipeline pipeline(slow[1], policy);
+        std::atomic<bool> done { false };
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < producers; ++t)
+            threads.emplace_back([&pipeline, &done] {
+                ebson11::Encoder encoder;
+                for (int32_t i = 0; !done.load(); ++i) {
+                    encoder.restart();
+                    encoder.encode_int32(i, "seq");
+                    pipeline.push(encoder);
+                }
+            });
+
+        ebson11::Encoder encoder;
+        bool flushed = true;
+        for (int32_t i = 0; i < 10; ++i) {
+            encoder.restart();
+            encoder.encode_int32(i, "seq");
+            pipeline.push(encoder);
+            const auto pushed = pipeline.stats().docsPushed;
+            pipeline.flush();
+            flushed = flushed && pipeline.stats().docsWritten >= pushed;
+        }
+        done.store(true);
+        for (auto& t : threads)
+            t.join();
+        check(flushed && !pipeline.stats().writeErrors, "flush: returns under concurrent pushes, all earlier documents written");
+    }
+    close(slow[1]);
+    slowReader.join();
+    close(slow[0]);
+}
+
+ebson11::DocumentView view(const ebson11::Encoder::BufType_t& buf)
+{
+    return ebson11::DocumentView(buf.begin(), buf.size());
+}
+
+// one version of a document: mutation picks which fields differ from version 0
+void encode_version(ebson11::Encoder& encoder, unsigned mutation, int arrayLength)
+{
+    encoder.restart();
+    encoder.encode_int32(mutation & 1 ? 2 : 1, "a");
+    if (!(mutation & 2))
+        encoder.encode_string("unchanged", "s");
+    {
+        ebson11::DocumentGuard sub(encoder, false, "sub");
+        encoder.encode_int32(1, "n");
+        encoder.encode_string(mutation & 4 ? "changed" : "original", "k");
+    }
+    {
+        ebson11::DocumentGuard arr(encoder, true, "arr");
+        for (int i = 0; i < arrayLength; ++i)
+            arr.encode_int32(i);
+    }
+    if (mutation & 8)
+        encoder.encode_double(0.5, "added");
+}
+
+void test_delta()
+{
+    ebson11::Encoder oldEnc, newEnc;
+    std::vector<uint8_t> delta, patched;
+
+    encode_version(oldEnc, 0, 2);
+    const auto& oldBuf = oldEnc.finalize();
+    encode_version(newEnc, 0, 2);
+    const auto& sameBuf = newEnc.finalize();
+    ebson11::diff_documents(view(oldBuf), view(sameBuf), delta);
+    check(delta.empty(), "delta: identical documents give an empty delta");
+
+    std::mt19937 rng(42);
+    for (int i = 0; i < 500; ++i) {
+        const unsigned oldMutation = rng() % 16, newMutation = rng() % 16;
+        encode_version(oldEnc, oldMutation, rng() % 5);
+        encode_version(newEnc, newMutation, rng() % 5);
+        const auto& from = oldEnc.finalize();
+        const auto& to = newEnc.finalize();
+
+        delta.clear();
+        patched.clear();
+        ebson11::diff_documents(view(from), view(to), delta);
+        const bool ok = ebson11::patch_document(view(from), delta, patched);
+        if (!ok || patched.size() != to.size() || memcmp(&patched[0], to.begin(), to.size())) {
+            check(false, "delta: patch_document() reproduces the new version byte-exactly");
+            return;
+        }
+    }
+}
+
+bool filter_matches(const ebson11::Query& query, const ebson11::Encoder::BufType_t& buf)
+{
+    return ebson11::Filter(query).matches(view(buf));
+}
+
+void test_filter()
+{
+    typedef ebson11::Query Q;
+    const int64_t big = int64_t(1) << 60;
+
+    ebson11::Encoder encoder;
+    encoder.restart();
+    encoder.encode_int32(5, "id");
+    encoder.encode_double(10, "score");
+    encoder.encode_int64(big, "big");
+    encoder.encode_bool(true, "flag");
+    encoder.encode_string("abc", "name");
+    encoder.encode_int32(1, "scalar");
+    {
+        ebson11::DocumentGuard sub(encoder, false, "sub");
+        sub.encode_string("x", "kind");
+    }
+    const auto& doc = encoder.finalize();
+
+    // equality, numbers match across int32, int64 and double
+    check(filter_matches(Q().eq("id", 5), doc), "filter: eq int32");
+    check(!filter_matches(Q().eq("id", 6), doc), "filter: eq int32 mismatch");
+    check(filter_matches(Q().eq("id", 5.0), doc), "filter: eq double on int32");
+    check(filter_matches(Q().eq("score", 10), doc), "filter: eq int32 on double");
+    check(filter_matches(Q().eq("id", int64_t(5)).eq("id", 5u), doc), "filter: eq int64_t and unsigned");
+    check(filter_matches(Q().eq("big", big), doc), "filter: eq int64");
+    check(filter_matches(Q().eq("big", big + 1), doc), "filter: int64 beyond 2^53 compared as double");
+    check(filter_matches(Q().eq("name", "abc").eq("flag", true).eq("sub.kind", "x"), doc), "filter: eq string, bool and nested");
+    check(!filter_matches(Q().eq("name", "ab"), doc), "filter: eq string prefix");
+    check(!filter_matches(Q().eq("id", 5).eq("flag", false), doc), "filter: conjunction fails on one term");
+
+    // ranges are inclusive, lt/gt exclude the bound itself
+    check(filter_matches(Q().range("score", 10, 15), doc), "filter: range lower bound");
+    check(filter_matches(Q().range("score", 5, 10), doc), "filter: range upper bound");
+    check(!filter_matches(Q().range("score", 10.5, 15), doc), "filter: range above");
+    check(!filter_matches(Q().lt("score", 10), doc) && filter_matches(Q().lt("score", 10.5), doc), "filter: lt");
+    check(filter_matches(Q().lte("score", 10), doc) && !filter_matches(Q().lte("score", 9.5), doc), "filter: lte");
+    check(!filter_matches(Q().gt("score", 10), doc) && filter_matches(Q().gt("score", 9.5), doc), "filter: gt");
+    check(filter_matches(Q().gte("score", 10), doc) && !filter_matches(Q().gte("score", 10.5), doc), "filter: gte");
+    check(!filter_matches(Q().lt("id", 5), doc) && filter_matches(Q().lt("id", 6), doc), "filter: lt int32");
+    check(!filter_matches(Q().gt("id", 5), doc) && filter_matches(Q().gt("id", 4), doc), "filter: gt int32");
+
+    // exists, also through a field which isn't a document
+    check(filter_matches(Q().exists("name").exists("sub.kind"), doc), "filter: exists");
+    check(!filter_matches(Q().exists("nope"), doc) && !filter_matches(Q().exists("sub.nope"), doc), "filter: exists on missing");
+    check(filter_matches(Q().exists("nope", false).exists("sub.nope", false), doc), "filter: missing");
+    check(!filter_matches(Q().exists("name", false), doc), "filter: missing on present");
+    check(!filter_matches(Q().exists("scalar.x"), doc), "filter: exists through a non-document");
+    check(filter_matches(Q().exists("scalar.x", false).exists("name.x", false), doc), "filter: missing through a non-document");
+    check(!filter_matches(Q().eq("scalar.x", 1), doc), "filter: eq through a non-document");
+
+    // types other than numbers have to match exactly
+    check(!filter_matches(Q().eq("flag", 1), doc), "filter: number against bool");
+    check(!filter_matches(Q().eq("id", true), doc), "filter: bool against int32");
+    check(!filter_matches(Q().eq("name", 5), doc), "filter: number against string");
+    check(!filter_matches(Q().eq("id", "5"), doc), "filter: string against int32");
+    check(!filter_matches(Q().eq("flag", "true"), doc), "filter: string against bool");
+    check(!filter_matches(Q().range("sub", 0, 100), doc), "filter: range against a document");
+
+    // select() appends the indices of the matches, invalid views never match
+    std::vector<ebson11::Encoder::BufType_t> bufs(10);
+    std::vector<ebson11::DocumentView> docs;
+    for (int i = 0; i < 10; ++i) {
+        encoder.restart();
+        encoder.encode_int32(i, "id");
+        encoder.encode_bool(i % 2, "flag");
+        encoder.finalize(bufs[i]);
+        docs.push_back(view(bufs[i]));
+    }
+    docs.push_back(ebson11::DocumentView());
+
+    std::vector<uint32_t> selected { 99 };
+    const ebson11::Filter odd(Q().range("id", 3, 6).eq("flag", true));
+    check(odd.select(docs, selected) == 2, "filter: select() count");
+    check(selected == std::vector<uint32_t>({ 99, 3, 5 }), "filter: select() indices");
+    selected.clear();
+    check(!ebson11::Filter(Q().exists("id", false)).select(docs, selected) && selected.empty(), "filter: select() nothing");
+}
+
+void test_sort_keys()
+{
+    const double inf = std::numeric_limits<double>::infinity();
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    const double two63 = 9223372036854775808.0;
+
+    std::vector<ebson11::Encoder::BufType_t> bufs;
+    auto add = [&bufs](const std::function<void (ebson11::Encoder&)>& fill) {
+        ebson11::Encoder encoder;
+        encoder.encode_int32(0, "other");
+        fill(encoder);
+        bufs.emplace_back();
+        encoder.finalize(bufs.back());
+    };
+
+    add([](ebson11::Encoder&) {});    // missing sorts as null
+    add([](ebson11::Encoder& e) { e.encode_null("v"); });
+    for (int32_t v : std::initializer_list<int32_t> { INT32_MIN, -1, 0, 1, INT32_MAX })
+        add([v](ebson11::Encoder& e) { e.encode_int32(v, "v"); });
+    for (int64_t v : std::initializer_list<int64_t> { INT64_MIN, INT64_MIN + 1, -(int64_t(1) << 53), -1, 0, (int64_t(1) << 53) + 1, INT64_MAX })
+        add([v](ebson11::Encoder& e) { e.encode_int64(v, "v"); });
+    for (double v : { -inf, -two63, -1.5, -0.0, 0.0, 0.5, 1.0, 9007199254740992.0, two63, inf, nan })
+        add([v](ebson11::Encoder& e) { e.encode_double(v, "v"); });
+    add([](ebson11::Encoder& e) { e.encode_string("abc", "v"); });
+    add([](ebson11::Encoder& e) { e.encode_bool(false, "v"); });
+
+    for (bool ascending : { true, false }) {
+        ebson11::SortSpec spec;
+        spec.add("v", ascending).add("other");
+
+        std::vector<std::string> keys(bufs.size());
+        for (size_t i = 0; i < bufs.size(); ++i)
+            ebson11::append_sort_key(view(bufs[i]), spec, keys[i]);
+
+        for (size_t i = 0; i < bufs.size(); ++i)
+            for (size_t j = 0; j < bufs.size(); ++j) {
+                const int byKey = keys[i].compare(keys[j]);
+                const int byComparator = spec.compare(view(bufs[i]), view(bufs[j]));
+                if ((byKey > 0) - (byKey < 0) != byComparator) {
+                    printf("  values %zu and %zu, ascending %d\n", i, j, ascending);
+                    check(false, "sort keys order documents as SortSpec::compare() does");
+                    return;
+                }
+            }
+    }
+}
+
+typedef ebson11::Encoder::BufType_t Buffer;
+
+// mappings are rounded to 2 MiB huge pages, the heap buffers here never are: they grow
+// from sizes which aren't powers of two
+bool is_mapped(const Buffer& buf)
+{
+    const size_t unit = 2 * 1024 * 1024;
+    return buf.capacity() >= unit && !(buf.capacity() % unit);
+}
+
+void fill_pattern(Buffer& buf, size_t size, uint8_t seed)
+{
+    buf.resize(size);
+    for (size_t i = 0; i < size; ++i)
+        buf[i] = static_cast<uint8_t>(i * 131 + seed);
+}
+
+bool has_pattern(const Buffer& buf, size_t size, uint8_t seed)
+{
+    if (buf.size() != size)
+        return false;
+    for (size_t i = 0; i < size; ++i)
+        if (buf[i] != static_cast<uint8_t>(i * 131 + seed))
+            return false;
+    return true;
+}
+
+// whether [ptr, ptr + bytes) is still mapped
+bool is_resident(const void* ptr, size_t bytes)
+{
+    std::vector<unsigned char> pages(bytes / sysconf(_SC_PAGESIZE) + 1);
+    return !mincore(const_cast<void*>(ptr), bytes, pages.data());
+}
+
+void encode_strings(ebson11::Encoder& encoder, int count)
+{
+    encoder.restart();
+    for (int i = 0; i < count; ++i)
+        encoder.encode_string("some typical string", "s");
+    encoder.encode_int32(count, "count");
+}
+
+void test_large_buffers()
+{
+    auto& config = ebson11::large_buffer_config();
+    const auto saved = config;
+    config.threshold = 64 * 1024;
+    config.hugePages = true;
+    ebson11::trim_large_buffers();
+
+    // a document moving from the heap to a mapping at 64 KiB and growing it with
+    // mremap() to 8 MiB comes out the same as one encoded on the heap only
+    const int strings = 300000;
+    ebson11::Encoder heapEncoder(1000), mappedEncoder(1000);
+    config.threshold = SIZE_MAX;
+    encode_strings(heapEncoder, strings);
+    const auto& heapDoc = heapEncoder.finalize();
+    config.threshold = 64 * 1024;
+    encode_strings(mappedEncoder, strings);
+    Buffer mappedDoc;
+    mappedEncoder.finalize(mappedDoc);
+
+    check(!is_mapped(heapDoc), "large buffers: the threshold disables mappings");
+    check(is_mapped(mappedDoc) && mappedDoc.capacity() > 2 * 1024 * 1024, "large buffers: encoder buffer mapped and grown");
+    check(mappedDoc == heapDoc, "large buffers: mapped document bytes equal heap ones");
+    const ebson11::DocumentView doc(mappedDoc.begin(), mappedDoc.size());
+    check(doc.valid() && doc.find("count").as_int32() == strings, "large buffers: mapped document reads back");
+
+    // swaps and copies between mapped and heap buffers keep the bytes and the ownership
+    Buffer small, large;
+    fill_pattern(small, 1000, 1);
+    fill_pattern(large, 200 * 1024, 2);
+    check(!is_mapped(small) && is_mapped(large), "large buffers: mapped past the threshold only");
+    small.swap(large);
+    check(has_pattern(small, 200 * 1024, 2) && is_mapped(small), "large buffers: mapped buffer swapped in");
+    check(has_pattern(large, 1000, 1) && !is_mapped(large), "large buffers: heap buffer swapped in");
+    Buffer copy(small);
+    check(has_pattern(copy, 200 * 1024, 2) && is_mapped(copy), "large buffers: mapped buffer copied");
+    copy = large;
+    check(has_pattern(copy, 1000, 1), "large buffers: heap buffer copied over a mapped one");
+    large = small;
+    check(has_pattern(large, 200 * 1024, 2) && is_mapped(large), "large buffers: mapped buffer copied over a heap one");
+
+    // a freed mapping is handed out again, until trim_large_buffers() unmaps it
+    const void* freed = nullptr;
+    {
+        Buffer temp;
+        fill_pattern(temp, 100 * 1024, 3);
+        freed = temp.begin();
+    }
+    check(is_resident(freed, 2 * 1024 * 1024), "large buffers: freed mapping cached");
+    {
+        Buffer reused;
+        fill_pattern(reused, 100 * 1024, 4);
+        check(reused.begin() == freed && has_pattern(reused, 100 * 1024, 4), "large buffers: cached mapping reused");
+    }
+    ebson11::trim_large_buffers();
+    check(!is_resident(freed, 2 * 1024 * 1024), "large buffers: trim_large_buffers() unmaps cached mappings");
+
+    // a thread_local buffer created before the mapping cache of its thread is destroyed
+    // after it, and has to be unmapped directly then
+    bool filled = false;
+    std::thread([&filled] {
+        static thread_local ebson11::Encoder::BufType_t late;
+        late.resize(256 * 1024);
+        memset(&late[0], 0x5a, late.size());
+        filled = late[late.size() - 1] == 0x5a;
+    }).join();
+    check(filled, "large buffers: thread_local mapped buffer freed after the thread's cache");
+
+    config = saved;
+    ebson11::trim_large_buffers();
+}
+
+bool has_bytes(const Buffer& buf, const std::vector<uint8_t>& expected, const char* what)
+{
+    if (buf.size() == expected.size() && std::equal(expected.begin(), expected.end(), buf.begin()))
+        return true;
+
+    printf("  %s: got", what);
+    for (const uint8_t *i = buf.begin(); i < buf.end(); ++i)
+        printf(" %02x", *i);
+    printf("\n  %s: expected", what);
+    for (auto b : expected)
+        printf(" %02x", b);
+    printf("\n");
+    return false;
+}
+
+std::vector<uint8_t> string_element(size_t length)
+{
+    const uint32_t prefix = length + 1;
+    std::vector<uint8_t> bytes { 0x02, 's', 0,
+            uint8_t(prefix), uint8_t(prefix >> 8), uint8_t(prefix >> 16), uint8_t(prefix >> 24) };
+    bytes.insert(bytes.end(), length, 'x');
+    bytes.push_back(0);
+    return bytes;
+}
+
+void test_types()
+{
+    ebson11::ObjectId oid;
+    for (int i = 0; i < 12; ++i)
+        oid.bytes[i] = 0xa0 + i;
+    const char bin[] = { 1, 2, 3 };
+
+    ebson11::Encoder encoder;
+    encoder.encode_int64(0x0102030405060708LL, "i");
+    encoder.encode_datetime(-2, "d");
+    encoder.encode_timestamp(0x01020304, 0x0a0b0c0d, "t");
+    encoder.encode_null("n");
+    encoder.encode_binary(bin, sizeof(bin), 0x80, "b");
+    encoder.encode_objectid(oid, "o");
+
+    const std::vector<uint8_t> expected {
+        0x43, 0x00, 0x00, 0x00,
+        0x12, 'i', 0, 0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01,
+        0x09, 'd', 0, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0x11, 't', 0, 0x0d, 0x0c, 0x0b, 0x0a, 0x04, 0x03, 0x02, 0x01,  // increment, then seconds
+        0x0a, 'n', 0,
+        0x05, 'b', 0, 0x03, 0x00, 0x00, 0x00, 0x80, 0x01, 0x02, 0x03,
+        0x07, 'o', 0, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab,
+        0x00
+    };
+    check(has_bytes(encoder.finalize(), expected, "types"), "types: int64, datetime, timestamp, null, binary and objectid bytes");
+
+    // the length prefix is a full int32, not the lowest byte of it
+    for (size_t length : { 254, 255, 256, 300, 70000 }) {
+        encoder.restart();
+        encoder.encode_string(std::string(length, 'x').c_str(), "s");
+
+        auto expected = string_element(length);
+        const uint32_t total = expected.size() + 5;
+        expected.insert(expected.begin(), { uint8_t(total), uint8_t(total >> 8), uint8_t(total >> 16), uint8_t(total >> 24) });
+        expected.push_back(0);
+        check(has_bytes(encoder.finalize(), expected, "string"), "types: string length prefix");
+    }
+
+    std::vector<std::vector<ebson11::ObjectId>> perThread(4);
+    std::vector<std::thread> threads;
+    for (auto& ids : perThread)
+        threads.emplace_back([&ids] {
+            for (int i = 0; i < 100000; ++i)
+                ids.push_back(ebson11::ObjectId::generate());
+        });
+    for (auto& t : threads)
+        t.join();
+
+    std::vector<ebson11::ObjectId> all;
+    for (const auto& ids : perThread)
+        all.insert(all.end(), ids.begin(), ids.end());
+    std::sort(all.begin(), all.end());
+    check(std::adjacent_find(all.begin(), all.end()) == all.end(), "types: ObjectId::generate() is unique across threads");
+
+    // bytes 4..8 are the per-thread discriminator, 9..11 the counter
+    auto sameDiscriminator = [](const ebson11::ObjectId& a, const ebson11::ObjectId& b) { return !memcmp(a.bytes + 4, b.bytes + 4, 5); };
+    auto sameCounter = [](const ebson11::ObjectId& a, const ebson11::ObjectId& b) { return !memcmp(a.bytes + 9, b.bytes + 9, 3); };
+
+    ebson11::detail::objectid_thread_state state;
+    ebson11::ObjectId first, last;
+    state.fill(first);
+    bool kept = true;
+    for (int i = 1; i < (1 << 24) - 1; ++i) {
+        state.fill(last);
+        kept = kept && sameDiscriminator(last, first);
+    }
+    check(kept, "types: ObjectId discriminator is kept until the counter wraps");
+
+    // the 2^24th id would have repeated the counter of the first one
+    ebson11::ObjectId wrapped;
+    state.fill(wrapped);
+    check(!sameCounter(last, first), "types: ObjectId counter doesn't repeat before the wrap");
+    check(!sameDiscriminator(wrapped, first), "types: ObjectId discriminator is renewed on counter wrap");
+}
+
+void test_instrumentation()
+{
+    const auto before = ebson11::CountingInstrumentation::snapshot();
+
+    // encoded by a thread which exits before the snapshot is taken
+    size_t threadDocSize = 0;
+    std::thread([&threadDocSize] {
+        ebson11::InstrumentedEncoder encoder(16);
+        encoder.encode_int32(1, "a");           // 1 + 2 + 4
+        encoder.encode_string("hello", "s");    // 1 + 2 + 4 + 6
+        {
+            ebson11::DocumentGuardT<ebson11::InstrumentedEncoder> sub(encoder, false, "sub");    // 1 + 4
+            encoder.encode_int64(2, "x");       // 1 + 2 + 8
+            ebson11::DocumentGuardT<ebson11::InstrumentedEncoder> arr(encoder, true, "arr");     // 1 + 4
+        }
+        threadDocSize = encoder.finalize().size();
+    }).join();
+
+    auto stats = ebson11::CountingInstrumentation::snapshot();
+    stats -= before;
+    check(stats.calls[0x10] == 1 && stats.bytes[0x10] == 7, "instrumentation: exited thread's int32 counters are kept");
+    check(stats.calls[0x02] == 1 && stats.bytes[0x02] == 13, "instrumentation: string calls and bytes");
+    check(stats.calls[0x03] == 1 && stats.bytes[0x03] == 5, "instrumentation: document start calls and bytes");
+    check(stats.calls[0x04] == 1 && stats.bytes[0x04] == 5, "instrumentation: array start calls and bytes");
+    check(stats.calls[0x12] == 1 && stats.bytes[0x12] == 11, "instrumentation: int64 calls and bytes");
+    check(stats.depth[1] == 1 && stats.depth[2] == 1 && stats.depth[3] == 1, "instrumentation: depth histogram");
+    check(stats.growths >= 1 && stats.grownBytes >= threadDocSize - 16, "instrumentation: growths past a small reserve");
+    check(stats.finalizes == 1 && stats.finalizedBytes == threadDocSize, "instrumentation: finalizes");
+
+    ebson11::InstrumentedEncoder encoder;
+    for (int i = 0; i < 3; ++i)
+        encoder.encode_null("n");
+    const size_t docSize = encoder.finalize().size();
+
+    stats = ebson11::CountingInstrumentation::snapshot();
+    stats -= before;
+    check(stats.calls[0x0a] == 3 && stats.bytes[0x0a] == 9, "instrumentation: null calls and bytes");
+    check(stats.calls[0x10] == 1 && stats.calls[0x02] == 1, "instrumentation: live and exited threads are summed");
+    check(stats.depth[1] == 2 && stats.depth[2] == 1, "instrumentation: depth histogram over threads");
+    check(stats.finalizes == 2 && stats.finalizedBytes == threadDocSize + docSize, "instrumentation: finalizes over threads");
+}
+
 } // anon namespace
 
 int main( int argc, char* argv[]) 
@@ -56,5 +719,15 @@ int main( int argc, char* argv[])
     }
     printf("\n");
 
-    return 0;
+    test_hashing();
+    test_projection_hints();
+    test_flush_pipeline();
+    test_delta();
+    test_sort_keys();
+    test_large_buffers();
+    test_filter();
+    test_types();
+    test_instrumentation();
+
+    return failures ? 1 : 0;
 }
@@ -0,0 +1,545 @@
+/**********************************************************************
+ * eBSON11 — BSON encoder in C++11.
+ *
+ * Copyright (C) 2013  Georg Rudoy		<georg@barzer.net>
+ * Copyright (C) 2013  Andre Yanpolsky	<andre@barzer.net>
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **********************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include "bsonreader.h"
+
+namespace ebson11
+{
+namespace detail
+{
+	/** @brief MongoDB's canonical type order: MinKey < undefined < null < numbers <
+	 * strings < objects < arrays < binary < ObjectId < bool < date < timestamp < regex <
+	 * DBPointer < code < code with scope < MaxKey. Returns 0 for unknown types.
+	 */
+	inline uint8_t canonical_rank(uint8_t type)
+	{
+		switch (type)
+		{
+		case 0xFF: return 1;
+		case 0x06: return 2;
+		case 0x0A: return 6;
+		case 0x01:
+		case 0x10:
+		case 0x12:
+		case 0x13: return 11;
+		case 0x02:
+		case 0x0E: return 16;
+		case 0x03: return 21;
+		case 0x04: return 26;
+		case 0x05: return 31;
+		case 0x07: return 36;
+		case 0x08: return 41;
+		case 0x09: return 46;
+		case 0x11: return 48;
+		case 0x0B: return 51;
+		case 0x0C: return 56;
+		case 0x0D: return 61;
+		case 0x0F: return 66;
+		case 0x7F: return 128;
+		default: return 0;
+		}
+	}
+
+	// what missing fields compare as
+	inline Element null_element()
+	{
+		static const uint8_t raw[] = { 0x0A, 0, 0 };
+
+		Element e;
+		e.parse(raw, raw + 2);
+		return e;
+	}
+
+	template<typename T>
+	int cmp3(T a, T b) { return (b < a) - (a < b); }
+
+	inline int compare_bytes(const uint8_t *a, size_t aSize, const uint8_t *b, size_t bSize)
+	{
+		const int r = std::memcmp(a, b, std::min(aSize, bSize));
+		return r ? (r < 0 ? -1 : 1) : cmp3(aSize, bSize);
+	}
+
+	// exact comparison of an int64 and a non-NaN double
+	inline int compare_int64_double(int64_t i, double d)
+	{
+		if (d < -9223372036854775808.0)
+			return 1;
+		if (d >= 9223372036854775808.0)
+			return -1;
+
+		const double t = std::trunc(d);
+		const int64_t ti = static_cast<int64_t>(t);
+		if (i != ti)
+			return cmp3(i, ti);
+		return cmp3(0.0, d - t);
+	}
+
+	/** @brief Numbers are compared by value across int32, int64 and double, NaN being
+	 * less than any other number. Decimal128 values aren't decoded, they sort after all the
+	 * other numbers by their raw bytes.
+	 */
+	inline int compare_numbers(const Element& a, const Element& b)
+	{
+		const bool aDec = a.type() == 0x13;
+		const bool bDec = b.type() == 0x13;
+		if (aDec || bDec)
+			return aDec && bDec ? compare_bytes(a.value(), 16, b.value(), 16) : (aDec ? 1 : -1);
+
+		const bool aInt = a.type() != 0x01;
+		const bool bInt = b.type() != 0x01;
+		const int64_t ai = !aInt ? 0 : a.type() == 0x10 ? a.as_int32() : a.as_int64();
+		const int64_t bi = !bInt ? 0 : b.type() == 0x10 ? b.as_int32() : b.as_int64();
+
+		if (aInt && bInt)
+			return cmp3(ai, bi);
+
+		const double ad = aInt ? 0 : a.as_double();
+		const double bd = bInt ? 0 : b.as_double();
+		const bool aNan = !aInt && std::isnan(ad);
+		const bool bNan = !bInt && std::isnan(bd);
+		if (aNan || bNan)
+			return aNan - bNan ? (aNan ? -1 : 1) : 0;
+
+		if (aInt)
+			return compare_int64_double(ai, bd);
+		if (bInt)
+			return -compare_int64_double(bi, ad);
+		return cmp3(ad, bd);
+	}
+
+	inline int compare_documents(const DocumentView& a, const DocumentView& b);
+
+	// values of types of the same canonical rank
+	inline int compare_values(const Element& a, const Element& b)
+	{
+		switch (a.type())
+		{
+		case 0x01:
+		case 0x10:
+		case 0x12:
+		case 0x13:
+			return compare_numbers(a, b);
+		case 0x02:
+		case 0x0E:
+			return compare_bytes(a.value() + 4, a.string_size(), b.value() + 4, b.string_size());
+		case 0x03:
+		case 0x04:
+			return compare_documents(a.as_document(), b.as_document());
+		case 0x05:
+			{
+				const int32_t aSize = load_int32(a.value());
+				const int32_t bSize = load_int32(b.value());
+				if (aSize != bSize)
+					return cmp3(aSize, bSize);
+				if (a.value()[4] != b.value()[4])
+					return cmp3(a.value()[4], b.value()[4]);
+				return compare_bytes(a.value() + 5, aSize, b.value() + 5, bSize);
+			}
+		case 0x08:
+			return cmp3(a.as_bool(), b.as_bool());
+		case 0x09:
+			return cmp3(a.as_int64(), b.as_int64());
+		case 0x11:
+			return cmp3(static_cast<uint64_t>(a.as_int64()), static_cast<uint64_t>(b.as_int64()));
+		case 0x06:
+		case 0x0A:
+		case 0x7F:
+		case 0xFF:
+			return 0;
+		default:
+			return compare_bytes(a.value(), a.value_size(), b.value(), b.value_size());
+		}
+	}
+} // namespace detail
+
+/** @brief Compares two element values following MongoDB's canonical type order.
+ *
+ * Returns a negative number, zero or a positive number. Field names are ignored.
+ */
+inline int compare_elements(const Element& a, const Element& b)
+{
+	const uint8_t aRank = detail::canonical_rank(a.type());
+	const uint8_t bRank = detail::canonical_rank(b.type());
+	if (aRank != bRank)
+		return detail::cmp3(aRank, bRank);
+	return detail::compare_values(a, b);
+}
+
+/** @brief Compares two encoded documents element by element: type rank, then field name,
+ * then value, a document being less than the ones it is a prefix of.
+ */
+inline int compare_documents(const DocumentView& a, const DocumentView& b)
+{
+	return detail::compare_documents(a, b);
+}
+
+inline int detail::compare_documents(const DocumentView& a, const DocumentView& b)
+{
+	auto ai = a.begin(), ae = a.end();
+	auto bi = b.begin(), be = b.end();
+	for (; ai != ae && bi != be; ++ai, ++bi)
+	{
+		const uint8_t aRank = canonical_rank(ai->type());
+		const uint8_t bRank = canonical_rank(bi->type());
+		if (aRank != bRank)
+			return cmp3(aRank, bRank);
+
+		const int names = std::strcmp(ai->name(), bi->name());
+		if (names)
+			return names < 0 ? -1 : 1;
+
+		const int values = compare_values(*ai, *bi);
+		if (values)
+			return values;
+	}
+	return cmp3(ai != ae, bi != be);
+}
+
+/** @brief A list of dotted key paths with their directions to sort documents by.
+ *
+ * Missing fields sort as nulls. Arrays compare as whole values, unlike MongoDB's sort
+ * which uses their smallest (or largest) element.
+ */
+class SortSpec
+{
+	struct Key
+	{
+		std::string path;
+		bool ascending;
+	};
+	std::vector<Key> d_keys;
+public:
+	SortSpec& add(const std::string& path, bool ascending = true)
+	{
+		d_keys.push_back({ path, ascending });
+		return *this;
+	}
+
+	size_t size() const { return d_keys.size(); }
+	const std::string& path(size_t i) const { return d_keys[i].path; }
+	bool ascending(size_t i) const { return d_keys[i].ascending; }
+
+	/** @brief Compares two documents by the keys, returns -1, 0 or 1.
+	 */
+	int compare(const DocumentView& a, const DocumentView& b) const
+	{
+		const Element nullElem = detail::null_element();
+		for (const auto& k : d_keys)
+		{
+			Element ae = a.find_path(k.path.c_str());
+			Element be = b.find_path(k.path.c_str());
+			const int r = compare_elements(ae ? ae : nullElem, be ? be : nullElem);
+			if (r)
+				return k.ascending ? r : -r;
+		}
+		return 0;
+	}
+};
+
+namespace detail
+{
+	inline void append_be(std::string& out, uint64_t v, int bytes)
+	{
+		for (int i = bytes - 1; i >= 0; --i)
+			out.push_back(static_cast<char>(v >> (8 * i)));
+	}
+
+	// zero bytes are escaped as 00 FF, the end is marked by 00 00
+	inline void append_escaped(std::string& out, const uint8_t *p, size_t size)
+	{
+		for (const uint8_t *end = p + size; p < end; )
+		{
+			const void *z = std::memchr(p, 0, end - p);
+			const uint8_t *stop = z ? static_cast<const uint8_t*>(z) : end;
+			out.append(reinterpret_cast<const char*>(p), stop - p);
+			if (stop == end)
+				break;
+			out.push_back(0);
+			out.push_back(static_cast<char>(0xff));
+			p = stop + 1;
+		}
+		out.push_back(0);
+		out.push_back(0);
+	}
+
+	inline void append_number_key(std::string& out, const Element& e)
+	{
+		if (e.type() == 0x13)
+		{
+			out.push_back(2);
+			out.append(reinterpret_cast<const char*>(e.value()), 16);
+			return;
+		}
+
+		double d;
+		int64_t residual = 0;
+		switch (e.type())
+		{
+		case 0x10:
+			d = e.as_int32();
+			break;
+		case 0x12:
+			{
+				const int64_t i = e.as_int64();
+				d = static_cast<double>(i);
+				// what the double lost, to order the int64 against doubles and other int64s
+				residual = d >= 9223372036854775808.0 ?
+						(i - std::numeric_limits<int64_t>::max()) - 1 :
+						i - static_cast<int64_t>(d);
+			}
+			break;
+		default:
+			d = e.as_double();
+			if (std::isnan(d))
+			{
+				out.push_back(0);
+				return;
+			}
+		}
+
+		if (d == 0)
+			d = 0;	// -0.0 == 0.0
+
+		uint64_t bits;
+		std::memcpy(&bits, &d, sizeof(bits));
+		bits = bits >> 63 ? ~bits : bits | (uint64_t(1) << 63);
+
+		out.push_back(1);
+		append_be(out, bits, 8);
+		append_be(out, static_cast<uint32_t>(static_cast<int32_t>(residual)) ^ 0x80000000u, 4);
+	}
+
+	inline void append_value_body(std::string& out, const Element& e)
+	{
+		switch (e.type())
+		{
+		case 0x01:
+		case 0x10:
+		case 0x12:
+		case 0x13:
+			append_number_key(out, e);
+			break;
+		case 0x02:
+		case 0x0E:
+			append_escaped(out, e.value() + 4, e.string_size());
+			break;
+		case 0x03:
+		case 0x04:
+			for (const auto& sub : e.as_document())
+			{
+				out.push_back(static_cast<char>(canonical_rank(sub.type())));
+				out.append(sub.name(), sub.name_size() + 1);
+				append_value_body(out, sub);
+			}
+			out.push_back(0);
+			break;
+		case 0x05:
+			append_be(out, static_cast<uint32_t>(load_int32(e.value())), 4);
+			out.append(reinterpret_cast<const char*>(e.value() + 4), e.value_size() - 4);
+			break;
+		case 0x07:
+			out.append(reinterpret_cast<const char*>(e.value()), 12);
+			break;
+		case 0x08:
+			out.push_back(e.as_bool());
+			break;
+		case 0x09:
+			append_be(out, static_cast<uint64_t>(e.as_int64()) ^ (uint64_t(1) << 63), 8);
+			break;
+		case 0x11:
+			append_be(out, static_cast<uint64_t>(e.as_int64()), 8);
+			break;
+		case 0x06:
+		case 0x0A:
+		case 0x7F:
+		case 0xFF:
+			break;
+		default:
+			append_escaped(out, e.value(), e.value_size());
+		}
+	}
+
+	inline void append_value_key(std::string& out, const Element& e)
+	{
+		out.push_back(static_cast<char>(canonical_rank(e.type())));
+		append_value_body(out, e);
+	}
+} // namespace detail
+
+/** @brief Appends the normalized sort key of \em doc to \em out.
+ *
+ * Keys of two documents compare with memcmp (shorter first on a common prefix) exactly
+ * as SortSpec::compare() compares the documents, so sorting can work on keys alone.
+ * Descending keys are stored with all their bytes inverted.
+ */
+inline void append_sort_key(const DocumentView& doc, const SortSpec& spec, std::string& out)
+{
+	for (size_t i = 0; i < spec.size(); ++i)
+	{
+		const size_t start = out.size();
+
+		const Element e = doc.find_path(spec.path(i).c_str());
+		if (e)
+			detail::append_value_key(out, e);
+		else
+			out.push_back(static_cast<char>(detail::canonical_rank(0x0A)));
+
+		if (!spec.ascending(i))
+			for (size_t j = start; j < out.size(); ++j)
+				out[j] = ~out[j];
+	}
+}
+
+/** @brief Stably sorts \em docs by \em spec using up to \em threads threads.
+ *
+ * Sort keys are extracted once per document, chunks of the key array are sorted in
+ * parallel and then merged pairwise, also in parallel.
+ */
+inline void sort_documents(std::vector<DocumentView>& docs, const SortSpec& spec, size_t threads = 1)
+{
+	struct KeyRef
+	{
+		uint64_t prefix;	// first 8 key bytes, big-endian, zero padded
+		const char *key;
+		uint32_t size;
+		uint32_t idx;
+
+		bool operator<(const KeyRef& other) const
+		{
+			if (prefix != other.prefix)
+				return prefix < other.prefix;
+			const int r = std::memcmp(key, other.key, std::min(size, other.size));
+			if (r)
+				return r < 0;
+			if (size != other.size)
+				return size < other.size;
+			return idx < other.idx;
+		}
+	};
+
+	const size_t count = docs.size();
+	if (count < 2)
+		return;
+	if (!threads)
+		threads = 1;
+	threads = std::min(threads, count);
+
+	const size_t chunk = (count + threads - 1) / threads;
+	std::vector<std::string> arenas(threads);
+	std::vector<std::vector<size_t>> offsets(threads);
+	std::vector<KeyRef> refs(count);
+
+	auto parallel = [threads](const std::function<void (size_t)>& f)
+	{
+		if (threads == 1)
+			return f(0);
+
+		std::vector<std::thread> pool;
+		for (size_t t = 0; t < threads; ++t)
+			pool.emplace_back(f, t);
+		for (auto& t : pool)
+			t.join();
+	};
+
+	parallel([&](size_t t)
+	{
+		const size_t begin = std::min(count, t * chunk);
+		const size_t end = std::min(count, begin + chunk);
+
+		auto& arena = arenas[t];
+		auto& offs = offsets[t];
+		for (size_t i = begin; i < end; ++i)
+		{
+			offs.push_back(arena.size());
+			append_sort_key(docs[i], spec, arena);
+		}
+		offs.push_back(arena.size());
+
+		for (size_t i = begin; i < end; ++i)
+		{
+			auto& r = refs[i];
+			r.key = arena.data() + offs[i - begin];
+			r.size = offs[i - begin + 1] - offs[i - begin];
+			r.idx = i;
+
+			uint8_t pre[8] = { 0 };
+			std::memcpy(pre, r.key, std::min<size_t>(r.size, 8));
+			r.prefix = 0;
+			for (int b = 0; b < 8; ++b)
+				r.prefix = (r.prefix << 8) | pre[b];
+		}
+
+		std::sort(refs.begin() + begin, refs.begin() + end);
+	});
+
+	std::vector<KeyRef> tmp(count);
+	for (size_t width = chunk; width < count; width *= 2)
+	{
+		const size_t pairs = (count + 2 * width - 1) / (2 * width);
+		std::vector<std::thread> pool;
+		for (size_t p = 0; p < pairs; ++p)
+		{
+			const size_t begin = p * 2 * width;
+			const size_t mid = std::min(count, begin + width);
+			const size_t end = std::min(count, begin + 2 * width);
+			auto merge = [&refs, &tmp, begin, mid, end]
+			{
+				std::merge(refs.begin() + begin, refs.begin() + mid,
+						refs.begin() + mid, refs.begin() + end, tmp.begin() + begin);
+			};
+
+			if (pairs == 1 || threads == 1)
+				merge();
+			else
+				pool.emplace_back(merge);
+		}
+		for (auto& t : pool)
+			t.join();
+		refs.swap(tmp);
+	}
+
+	std::vector<DocumentView> sorted;
+	sorted.reserve(count);
+	for (const auto& r : refs)
+		sorted.push_back(docs[r.idx]);
+	docs.swap(sorted);
+}
+} // namespace ebson11
@@ -0,0 +1,489 @@
+/**********************************************************************
+ * eBSON11 — BSON encoder in C++11.
+ *
+ * Copyright (C) 2013  Georg Rudoy		<georg@barzer.net>
+ * Copyright (C) 2013  Andre Yanpolsky	<andre@barzer.net>
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **********************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <utility>
+#include <cstring>
+#include "bsonreader.h"
+
+namespace ebson11
+{
+namespace detail
+{
+	enum DeltaOp : uint8_t
+	{
+		DELTA_SET = 1,		// payload: type byte + value
+		DELTA_UNSET = 2,	// no payload
+		DELTA_APPEND = 3	// payload: int32 size + raw elements to append to an array
+	};
+
+	inline void append_raw(std::vector<uint8_t>& out, const void *p, size_t size)
+	{
+		const auto b = static_cast<const uint8_t*>(p);
+		out.insert(out.end(), b, b + size);
+	}
+
+	inline void append_int32(std::vector<uint8_t>& out, int32_t v)
+	{
+		append_raw(out, &v, sizeof(v));
+	}
+
+	inline size_t name_hash(const char *p, size_t size)
+	{
+		size_t h = 14695981039346656037ULL;
+		for (size_t i = 0; i < size; ++i)
+			h = (h ^ static_cast<uint8_t>(p[i])) * 1099511628211ULL;
+		return h;
+	}
+
+	/** @brief Elements of a single document level indexed by name.
+	 */
+	class element_index
+	{
+		std::vector<Element> m_elems;
+		std::vector<int32_t> m_table;	// open addressing, indices into m_elems or -1
+		bool m_duplicates = false;
+	public:
+		explicit element_index(const DocumentView& doc)
+		{
+			for (const auto& e : doc)
+				m_elems.push_back(e);
+
+			size_t cap = 8;
+			while (cap < m_elems.size() * 2)
+				cap *= 2;
+			m_table.assign(cap, -1);
+
+			for (size_t i = 0; i < m_elems.size(); ++i)
+			{
+				const auto& e = m_elems[i];
+				for (size_t pos = name_hash(e.name(), e.name_size()) & (cap - 1); ; pos = (pos + 1) & (cap - 1))
+				{
+					if (m_table[pos] < 0)
+					{
+						m_table[pos] = i;
+						break;
+					}
+
+					const auto& other = m_elems[m_table[pos]];
+					if (other.name_size() == e.name_size() && !std::memcmp(other.name(), e.name(), e.name_size()))
+					{
+						m_duplicates = true;
+						break;
+					}
+				}
+			}
+		}
+
+		bool has_duplicates() const { return m_duplicates; }
+		size_t size() const { return m_elems.size(); }
+		const Element& operator[](size_t i) const { return m_elems[i]; }
+
+		int32_t find(const char *name, size_t size) const
+		{
+			const size_t mask = m_table.size() - 1;
+			for (size_t pos = name_hash(name, size) & mask; m_table[pos] >= 0; pos = (pos + 1) & mask)
+			{
+				const auto& e = m_elems[m_table[pos]];
+				if (e.name_size() == size && !std::memcmp(e.name(), name, size))
+					return m_table[pos];
+			}
+			return -1;
+		}
+	};
+
+	class delta_writer
+	{
+		std::vector<uint8_t>& m_out;
+		std::vector<std::pair<const char*, size_t>> m_path;
+
+		void op_header(DeltaOp op, const Element *last)
+		{
+			m_out.push_back(op);
+			m_out.push_back(static_cast<uint8_t>(m_path.size() + (last ? 1 : 0)));
+			for (const auto& c : m_path)
+				append_raw(m_out, c.first, c.second + 1);
+			if (last)
+				append_raw(m_out, last->name(), last->name_size() + 1);
+		}
+
+		void set(const Element& e)
+		{
+			op_header(DELTA_SET, &e);
+			m_out.push_back(e.type());
+			append_raw(m_out, e.value(), e.value_size());
+		}
+
+		static bool same(const Element& a, const Element& b)
+		{
+			return a.raw_size() == b.raw_size() && !std::memcmp(a.raw(), b.raw(), a.raw_size());
+		}
+
+		/** Emits the ops turning \em oldDoc into \em newDoc, or returns false without
+		 * emitting anything if they can't express it: new doc fields which are also in
+		 * the old one should keep their relative order and precede all the added fields.
+		 */
+		bool diff_level(const DocumentView& oldDoc, const DocumentView& newDoc)
+		{
+			const element_index olds(oldDoc);
+			if (olds.has_duplicates())
+				return false;
+
+			std::vector<int32_t> oldToNew(olds.size(), -1);
+			std::vector<Element> added;
+
+			int32_t lastMatched = -1;
+			int32_t newIdx = 0;
+			for (auto it = newDoc.begin(), end = newDoc.end(); it != end; ++it, ++newIdx)
+			{
+				const int32_t o = olds.find(it->name(), it->name_size());
+				if (o < 0)
+				{
+					added.push_back(*it);
+					continue;
+				}
+				if (o <= lastMatched || !added.empty())
+					return false;
+				oldToNew[o] = newIdx;
+				lastMatched = o;
+			}
+
+			auto newIt = newDoc.begin();
+			int32_t newPos = 0;
+			for (size_t i = 0; i < olds.size(); ++i)
+			{
+				const Element& oe = olds[i];
+				if (oldToNew[i] < 0)
+				{
+					op_header(DELTA_UNSET, &oe);
+					continue;
+				}
+
+				for (; newPos < oldToNew[i]; ++newPos)
+					++newIt;
+				const Element ne = *newIt;
+
+				if (same(oe, ne))
+					continue;
+
+				if (oe.type() == ne.type() && (oe.type() == 0x03 || oe.type() == 0x04))
+				{
+					const size_t oldBody = oe.value_size() - 5;
+					if (oe.type() == 0x04 && ne.value_size() > oe.value_size() &&
+							!std::memcmp(oe.value() + 4, ne.value() + 4, oldBody))
+					{
+						const size_t appended = ne.value_size() - oe.value_size();
+						op_header(DELTA_APPEND, &oe);
+						append_int32(m_out, appended);
+						append_raw(m_out, ne.value() + 4 + oldBody, appended);
+						continue;
+					}
+
+					m_path.emplace_back(oe.name(), oe.name_size());
+					const bool ok = m_path.size() < 255 && diff_level(oe.as_document(), ne.as_document());
+					m_path.pop_back();
+					if (ok)
+						continue;
+				}
+
+				set(ne);
+			}
+
+			for (const auto& e : added)
+				set(e);
+			return true;
+		}
+	public:
+		explicit delta_writer(std::vector<uint8_t>& out) : m_out(out) {}
+
+		void diff(const DocumentView& oldDoc, const DocumentView& newDoc)
+		{
+			if (diff_level(oldDoc, newDoc))
+				return;
+
+			// replacing the whole document
+			m_out.push_back(DELTA_SET);
+			m_out.push_back(0);
+			m_out.push_back(0x03);
+			append_raw(m_out, newDoc.data(), newDoc.size());
+		}
+	};
+
+	class delta_reader
+	{
+		struct Op
+		{
+			DeltaOp op;
+			size_t compBegin;
+			size_t compCount;
+			const uint8_t *payload;
+			size_t payloadSize;
+			uint8_t type;	// for sets
+		};
+
+		std::vector<Op> m_ops;
+		std::vector<std::pair<const char*, size_t>> m_comps;
+		size_t m_next = 0;
+
+		std::vector<std::pair<const char*, size_t>> m_path;
+		std::vector<uint8_t>& m_out;
+
+		// is the next op about the field \em name at the current path
+		bool next_is(const char *name, size_t size) const
+		{
+			if (m_next >= m_ops.size())
+				return false;
+
+			const Op& op = m_ops[m_next];
+			if (op.compCount <= m_path.size())
+				return false;
+			for (size_t i = 0; i < m_path.size(); ++i)
+			{
+				const auto& c = m_comps[op.compBegin + i];
+				if (c.second != m_path[i].second || std::memcmp(c.first, m_path[i].first, c.second))
+					return false;
+			}
+
+			const auto& c = m_comps[op.compBegin + m_path.size()];
+			return !name || (c.second == size && !std::memcmp(c.first, name, size));
+		}
+
+		void write_element(uint8_t type, const char *name, size_t nameSize, const uint8_t *value, size_t valueSize)
+		{
+			m_out.push_back(type);
+			append_raw(m_out, name, nameSize + 1);
+			append_raw(m_out, value, valueSize);
+		}
+
+		void patch_size(size_t offset)
+		{
+			const int32_t sz = m_out.size() - offset;
+			std::memcpy(&m_out[offset], &sz, sizeof(sz));
+		}
+
+		bool patch_level(const DocumentView& doc)
+		{
+			const size_t start = m_out.size();
+			append_int32(m_out, 0);
+
+			const uint8_t *run = nullptr;	// start of unchanged elements not copied yet
+			const uint8_t *runEnd = nullptr;
+			auto flush = [&]
+			{
+				if (run)
+					append_raw(m_out, run, runEnd - run);
+				run = nullptr;
+			};
+
+			for (const auto& e : doc)
+			{
+				if (!next_is(e.name(), e.name_size()))
+				{
+					if (!run)
+						run = e.raw();
+					runEnd = e.raw() + e.raw_size();
+					continue;
+				}
+				flush();
+
+				const Op& op = m_ops[m_next];
+				if (op.compCount > m_path.size() + 1)
+				{
+					if (e.type() != 0x03 && e.type() != 0x04)
+						return false;
+
+					m_out.insert(m_out.end(), e.raw(), e.value());
+					m_path.emplace_back(e.name(), e.name_size());
+					const bool ok = patch_level(e.as_document());
+					m_path.pop_back();
+					if (!ok)
+						return false;
+					continue;
+				}
+
+				++m_next;
+				switch (op.op)
+				{
+				case DELTA_UNSET:
+					break;
+				case DELTA_SET:
+					write_element(op.type, e.name(), e.name_size(), op.payload, op.payloadSize);
+					break;
+				case DELTA_APPEND:
+					{
+						if (e.type() != 0x04)
+							return false;
+
+						m_out.insert(m_out.end(), e.raw(), e.value());
+						const size_t arrStart = m_out.size();
+						append_raw(m_out, e.value(), e.value_size() - 1);
+						append_raw(m_out, op.payload, op.payloadSize);
+						m_out.push_back(0);
+						patch_size(arrStart);
+					}
+					break;
+				}
+			}
+			flush();
+
+			// fields added at the end of this level
+			while (next_is(nullptr, 0) && m_ops[m_next].compCount == m_path.size() + 1)
+			{
+				const Op& op = m_ops[m_next++];
+				if (op.op != DELTA_SET)
+					return false;
+
+				const auto& name = m_comps[op.compBegin + m_path.size()];
+				write_element(op.type, name.first, name.second, op.payload, op.payloadSize);
+			}
+
+			m_out.push_back(0);
+			patch_size(start);
+			return true;
+		}
+	public:
+		explicit delta_reader(std::vector<uint8_t>& out) : m_out(out) {}
+
+		bool parse(const uint8_t *p, size_t size)
+		{
+			const uint8_t *end = p + size;
+			while (p < end)
+			{
+				if (end - p < 2)
+					return false;
+
+				Op op;
+				op.op = static_cast<DeltaOp>(*p++);
+				op.compCount = *p++;
+				op.compBegin = m_comps.size();
+
+				for (size_t i = 0; i < op.compCount; ++i)
+				{
+					const void *z = std::memchr(p, 0, end - p);
+					if (!z)
+						return false;
+					const auto zp = static_cast<const uint8_t*>(z);
+					m_comps.emplace_back(reinterpret_cast<const char*>(p), zp - p);
+					p = zp + 1;
+				}
+
+				switch (op.op)
+				{
+				case DELTA_SET:
+					{
+						if (p >= end)
+							return false;
+						op.type = *p++;
+						const ptrdiff_t sz = value_size(op.type, p, end);
+						if (sz < 0)
+							return false;
+						op.payload = p;
+						op.payloadSize = sz;
+						p += sz;
+					}
+					break;
+				case DELTA_UNSET:
+					op.payload = nullptr;
+					op.payloadSize = 0;
+					break;
+				case DELTA_APPEND:
+					{
+						if (end - p < 4)
+							return false;
+						const int32_t sz = load_int32(p);
+						p += 4;
+						if (sz < 0 || sz > end - p)
+							return false;
+						op.payload = p;
+						op.payloadSize = sz;
+						p += sz;
+					}
+					break;
+				default:
+					return false;
+				}
+
+				if (!op.compCount && (op.op != DELTA_SET || op.type != 0x03))
+					return false;
+				m_ops.push_back(op);
+			}
+			return true;
+		}
+
+		bool apply(const DocumentView& doc)
+		{
+			if (!m_ops.empty() && !m_ops.front().compCount)
+			{
+				append_raw(m_out, m_ops.front().payload, m_ops.front().payloadSize);
+				return m_ops.size() == 1;
+			}
+
+			return patch_level(doc) && m_next == m_ops.size();
+		}
+	};
+} // namespace detail
+
+/** @brief Appends to \em delta the changes turning \em oldDoc into \em newDoc.
+ *
+ * The delta is a sequence of set, unset and array append operations keyed by field paths,
+ * in the order of the fields of \em oldDoc. Unchanged fields and subdocuments cost nothing,
+ * changed subdocuments are diffed recursively, and arrays which only grew at the end
+ * get an append with just the new elements. When field order can't be reproduced by those
+ * operations (fields reordered, or inserted before existing ones) the containing document
+ * is set as a whole. Both documents are walked once, with a hash index per level.
+ *
+ * An empty delta means the documents are byte-identical.
+ */
+inline void diff_documents(const DocumentView& oldDoc, const DocumentView& newDoc, std::vector<uint8_t>& delta)
+{
+	detail::delta_writer(delta).diff(oldDoc, newDoc);
+}
+
+/** @brief Applies \em delta produced by diff_documents() to \em oldDoc, appending the new
+ * document to \em out byte-exactly.
+ *
+ * Unchanged runs of fields and untouched subdocuments are copied with a single memcpy.
+ * Returns false if the delta is malformed or doesn't match \em oldDoc, \em out contents are
+ * unspecified then.
+ */
+inline bool patch_document(const DocumentView& oldDoc, const uint8_t *delta, size_t deltaSize, std::vector<uint8_t>& out)
+{
+	detail::delta_reader reader(out);
+	return oldDoc.valid() && reader.parse(delta, deltaSize) && reader.apply(oldDoc);
+}
+
+inline bool patch_document(const DocumentView& oldDoc, const std::vector<uint8_t>& delta, std::vector<uint8_t>& out)
+{
+	return patch_document(oldDoc, delta.empty() ? nullptr : &delta[0], delta.size(), out);
+}
+} // namespace ebson11
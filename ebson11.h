@@ -37,6 +37,10 @@
 #include <iostream>
 #include "stringnum.h"
 #include "uninit_vector.h"
+#include "inline_vector.h"
+#include "hash.h"
+#include "objectid.h"
+#include "instrumentation.h"
 
 namespace ebson11
 {
@@ -54,17 +58,44 @@ namespace detail
 		}
 
 		void encode_int32(int32_t i, const char *name = 0) { static_cast<Impl*>(this)->encode_type(i, 0x10, name); }
+		void encode_int64(int64_t i, const char *name = 0) { static_cast<Impl*>(this)->encode_type(i, 0x12, name); }
 		void encode_bool(bool i, const char *name = 0) { static_cast<Impl*>(this)->encode_type(static_cast<uint8_t>(i), 0x08, name); }
 
+		// milliseconds since the epoch
+		void encode_datetime(int64_t ms, const char *name = 0) { static_cast<Impl*>(this)->encode_type(ms, 0x09, name); }
+
+		// the internal MongoDB timestamp
+		void encode_timestamp(uint32_t seconds, uint32_t increment, const char *name = 0)
+		{
+			static_cast<Impl*>(this)->encode_type((static_cast<uint64_t>(seconds) << 32) | increment, 0x11, name);
+		}
+
+		void encode_null(const char *name = 0)
+		{
+			static_cast<Impl*>(this)->template encode_bytes<0, 0>("", 0, nullptr, nullptr, 0x0A, name);
+		}
+
+		void encode_objectid(const ObjectId& oid, const char *name = 0)
+		{
+			static_cast<Impl*>(this)->template encode_bytes<0, 0>(reinterpret_cast<const char*>(oid.bytes),
+					sizeof(oid.bytes), nullptr, nullptr, 0x07, name);
+		}
+
+		void encode_binary(const void *data, int32_t size, uint8_t subtype = 0, const char *name = 0)
+		{
+			char pre[5];
+			std::memcpy(pre, &size, 4);
+			pre[4] = subtype;
+
+			static_cast<Impl*>(this)->template encode_bytes<5, 0>(static_cast<const char*>(data), size,
+					pre, nullptr, 0x05, name);
+		}
+
 		void encode_string(const char *str, const char *name = 0)
 		{
-			char pre[4] = { 0 };
+			char pre[4];
 			const auto strlenp = static_cast<int32_t>(std::strlen(str)) + 1;
-
-			pre[0] = strlenp & 0x000000ff;
-			pre[1] = strlenp & 0x0000ff00;
-			pre[2] = strlenp & 0x00ff0000;
-			pre[3] = strlenp & 0xff000000;
+			std::memcpy(pre, &strlenp, 4);
 
 			char post = 0;
 
@@ -73,13 +104,25 @@ namespace detail
 	};
 } // namespace detail
 
-class DocumentGuard;
+template<typename Enc>
+class DocumentGuardT;
 
-template<template<typename, typename> class BufType = detail::uninit_vector>
-class EncoderT : public detail::TypeInterface<EncoderT<BufType>>
+/** @brief The BSON encoder.
+ *
+ * @param BufType The byte buffer, a std::vector-like class.
+ * @param HashPolicy NoHash, or PolyHash to compute the digest of the document while it
+ * is being encoded, see the finalize() overloads taking a digest.
+ * @param StackType The container of the nesting stack frames, a std::vector-like class.
+ * @param Instrumentation NoInstrumentation, which compiles to nothing, or
+ * CountingInstrumentation to gather per-type, depth, growth and finalize() statistics.
+ */
+template<template<typename, typename> class BufType = detail::uninit_vector, typename HashPolicy = NoHash,
+		template<typename, typename> class StackType = std::vector, typename Instrumentation = NoInstrumentation>
+class EncoderT : public detail::TypeInterface<EncoderT<BufType, HashPolicy, StackType, Instrumentation>>
 {
-	friend struct detail::TypeInterface<EncoderT<BufType>>;
-	friend class DocumentGuard;
+	friend struct detail::TypeInterface<EncoderT<BufType, HashPolicy, StackType, Instrumentation>>;
+	template<typename Enc>
+	friend class DocumentGuardT;
 public:
 	typedef BufType<uint8_t, std::allocator<uint8_t>> BufType_t;
 private:
@@ -91,9 +134,10 @@ private:
 		StackFrame() {}
 		StackFrame(int32_t sz, size_t szOffs) : size(sz), sizeOffset(szOffs) {}
 	};
-	std::vector<StackFrame> d_stk;
+	StackType<StackFrame, std::allocator<StackFrame>> d_stk;
 
 	BufType_t d_buf;
+	HashPolicy d_hash;
 
 	void* buf_at_offset(size_t offs) { return &(d_buf[offs]); }
 	void stack_increment_sz(int32_t sz) { d_stk.back().size+= sz; }
@@ -101,10 +145,35 @@ private:
 	void* new_bytes(size_t addSz)
 	{
 		const size_t offs = d_buf.size();
-		d_buf.resize(d_buf.size() + addSz);
+		// everything handed out by the previous calls has been written by now
+		if (HashPolicy::enabled && offs)
+			d_hash.update(static_cast<const uint8_t*>(buf_at_offset(0)), offs);
+
+		if (Instrumentation::enabled)
+		{
+			const size_t cap = d_buf.capacity();
+			d_buf.resize(d_buf.size() + addSz);
+			if (d_buf.capacity() != cap)
+				Instrumentation::on_growth(cap, d_buf.capacity());
+		}
+		else
+			d_buf.resize(d_buf.size() + addSz);
 		return buf_at_offset(offs);
 	}
 
+	void push_byte(const uint8_t& b)
+	{
+		if (Instrumentation::enabled)
+		{
+			const size_t cap = d_buf.capacity();
+			d_buf.push_back(b);
+			if (d_buf.capacity() != cap)
+				Instrumentation::on_growth(cap, d_buf.capacity());
+		}
+		else
+			d_buf.push_back(b);
+	}
+
 	void stack_pop()
 	{
 		if (d_stk.empty())
@@ -116,6 +185,7 @@ private:
 		const int32_t sz = d_stk.back().size;
 
 		*static_cast<int32_t*>(buf_at_offset(d_stk.back().sizeOffset)) = sz; // updating the size in the buffer
+		d_hash.patch_int32(d_stk.back().sizeOffset, sz);
 		d_stk.resize(d_stk.size() - 1);
 
 		if (!d_stk.empty())
@@ -126,7 +196,10 @@ private:
 	{
 		int32_t newSz = 4;
 		d_stk.push_back({ newSz, d_buf.size() });
-		new_bytes(sizeof(uint32_t));
+		Instrumentation::on_depth(d_stk.size());
+		void *sizePtr = new_bytes(sizeof(uint32_t));
+		if (HashPolicy::enabled) // the hash expects placeholders to be zeroes until patched
+			std::memset(sizePtr, 0, sizeof(uint32_t));
 	}
 
 	int32_t encode_name(const char *n)
@@ -142,11 +215,12 @@ private:
 	template<typename T>
 	void encode_type(T t, uint8_t typeId, const char *name)
 	{
-		d_buf.push_back(typeId);
+		push_byte(typeId);
 
 		const int32_t sz = 1 + encode_name(name) + sizeof(T);
 		*static_cast<T*>(new_bytes(sizeof(T))) = t;
 		stack_increment_sz(sz);
+		Instrumentation::on_value(typeId, sz);
 	}
 
 	template<int PreSize, int PostSize>
@@ -154,7 +228,7 @@ private:
 			const char *pre, const char *post,
 			uint8_t typeId, const char *name)
 	{
-		d_buf.push_back(typeId);
+		push_byte(typeId);
 
 		const int32_t sumSz = 1 + encode_name(name) + PreSize + bytesLength + PostSize;
 
@@ -170,9 +244,10 @@ private:
 			std::memcpy(mem, post, PostSize);
 
 		stack_increment_sz(sumSz);
+		Instrumentation::on_value(typeId, sumSz);
 	}
 public:
-	enum { DEFAULT_RESERVE_SZ = 1024*64 };
+	enum { DEFAULT_RESERVE_SZ = detail::default_reserve<BufType_t>::value };
 
 	EncoderT(size_t reserve = DEFAULT_RESERVE_SZ)
 	{
@@ -190,6 +265,7 @@ public:
 	{
 		d_buf.resize(0);
 		d_stk.clear();
+		d_hash.reset();
 		stack_push();
 	}
 
@@ -200,7 +276,9 @@ public:
 	 */
 	const BufType_t& finalize()
 	{
+		const auto timer = Instrumentation::finalize_begin();
 		stack_pop();
+		Instrumentation::finalize_end(timer, d_buf.size());
 		return d_buf;
 	}
 
@@ -214,15 +292,44 @@ public:
 	 */
 	void finalize(BufType_t& out)
 	{
+		const auto timer = Instrumentation::finalize_begin();
+		stack_pop();
+		Instrumentation::finalize_end(timer, d_buf.size());
+		d_buf.swap(out);
+	}
+
+	/** @brief Finalizes the document, stores its digest to \em digest and returns the buffer.
+	 *
+	 * Only available with a hashing HashPolicy. The digest is equal to the one computed by
+	 * hash_bytes() over the returned buffer, but only the last couple KiB of it are left to
+	 * be hashed here, the rest was hashed while still in cache.
+	 */
+	const BufType_t& finalize(typename HashPolicy::digest_type& digest)
+	{
+		static_assert(HashPolicy::enabled, "the encoder is not configured for hashing");
+		const auto timer = Instrumentation::finalize_begin();
 		stack_pop();
+		digest = d_hash.digest(static_cast<const uint8_t*>(buf_at_offset(0)), d_buf.size());
+		Instrumentation::finalize_end(timer, d_buf.size());
+		return d_buf;
+	}
+
+	/** @brief Finalizes the document, stores its digest to \em digest and moves the
+	 * buffer to \em out.
+	 */
+	void finalize(BufType_t& out, typename HashPolicy::digest_type& digest)
+	{
+		finalize(digest);
 		d_buf.swap(out);
 	}
 
 	// document or array begin (pushes the stack)
 	void document_start(bool isArr = false, const char *name = 0)
 	{
-		d_buf.push_back(isArr ? 0x4 : 0x3);
-		d_stk.back().size += encode_name(name) + 1;
+		push_byte(isArr ? 0x4 : 0x3);
+		const int32_t sz = encode_name(name) + 1;
+		d_stk.back().size += sz;
+		Instrumentation::on_value(isArr ? 0x4 : 0x3, sz);
 		stack_push();
 	}
 
@@ -231,12 +338,24 @@ public:
 };
 
 typedef EncoderT<> Encoder;
+typedef EncoderT<detail::uninit_vector, PolyHash> HashingEncoder;
+typedef EncoderT<detail::uninit_vector, NoHash, std::vector, CountingInstrumentation> InstrumentedEncoder;
+
+/** @brief An encoder keeping up to \em BufSize bytes and \em StackDepth nesting levels
+ * inline, so that encoding small documents doesn't touch the heap.
+ */
+template<size_t BufSize = 256, size_t StackDepth = 8>
+using SmallEncoderT = EncoderT<detail::inline_storage<BufSize>::template vector, NoHash,
+		detail::inline_storage<StackDepth>::template vector>;
 
-class DocumentGuard : public detail::TypeInterface<DocumentGuard>
+typedef SmallEncoderT<> SmallEncoder;
+
+template<typename Enc>
+class DocumentGuardT : public detail::TypeInterface<DocumentGuardT<Enc>>
 {
-	friend struct detail::TypeInterface<DocumentGuard>;
+	friend struct detail::TypeInterface<DocumentGuardT<Enc>>;
 
-	Encoder& m_encoder;
+	Enc& m_encoder;
 
 	const bool m_isArr;
 	StrRepDecimal m_arrIdx;
@@ -259,30 +378,32 @@ class DocumentGuard : public detail::TypeInterface<DocumentGuard>
 			uint8_t typeId, const char *name)
 	{
 		if (!m_isArr)
-			m_encoder.encode_bytes<PreSize, PostSize>(bytes, bytesLength, pre, post, typeId, name);
+			m_encoder.template encode_bytes<PreSize, PostSize>(bytes, bytesLength, pre, post, typeId, name);
 		else
 		{
-			m_encoder.encode_bytes<PreSize, PostSize>(bytes, bytesLength, pre, post, typeId, m_arrIdx.c_str());
+			m_encoder.template encode_bytes<PreSize, PostSize>(bytes, bytesLength, pre, post, typeId, m_arrIdx.c_str());
 			++m_arrIdx;
 		}
 	}
 public:
-	DocumentGuard(const DocumentGuard&) = delete;
-	DocumentGuard(DocumentGuard&&) = delete;
+	DocumentGuardT(const DocumentGuardT&) = delete;
+	DocumentGuardT(DocumentGuardT&&) = delete;
 
-	DocumentGuard& operator=(const DocumentGuard&) = delete;
-	DocumentGuard& operator=(DocumentGuard&&) = delete;
+	DocumentGuardT& operator=(const DocumentGuardT&) = delete;
+	DocumentGuardT& operator=(DocumentGuardT&&) = delete;
 
-	DocumentGuard(Encoder& e, bool isArr = false, const char *name = 0)
+	DocumentGuardT(Enc& e, bool isArr = false, const char *name = 0)
 	: m_encoder(e)
 	, m_isArr(isArr)
 	{
 		m_encoder.document_start(isArr, name );
 	}
 
-	~DocumentGuard()
+	~DocumentGuardT()
 	{
 		m_encoder.document_end();
 	}
 };
+
+typedef DocumentGuardT<Encoder> DocumentGuard;
 } // namespace ebson11
@@ -0,0 +1,296 @@
+/**********************************************************************
+ * eBSON11 — BSON encoder in C++11.
+ *
+ * Copyright (C) 2013  Georg Rudoy		<georg@barzer.net>
+ * Copyright (C) 2013  Andre Yanpolsky	<andre@barzer.net>
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **********************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include "bsonreader.h"
+
+namespace ebson11
+{
+namespace detail
+{
+	struct FilterCondition
+	{
+		enum Kind
+		{
+			Numeric,	// lo <= value <= hi, for int32, int64 and double values
+			Bool,
+			String,
+			Exists,
+			Missing
+		};
+
+		Kind kind;
+		double lo;
+		double hi;
+		bool b;
+		std::string str;
+
+		bool matches(const Element& e) const
+		{
+			switch (kind)
+			{
+			case Numeric:
+				{
+					double v;
+					switch (e.type())
+					{
+					case 0x01:
+						v = e.as_double();
+						break;
+					case 0x10:
+						v = e.as_int32();
+						break;
+					case 0x12:
+						// rounded to the nearest double past 2^53, so neighbouring values compare equal
+						v = e.as_int64();
+						break;
+					default:
+						return false;
+					}
+					return (v >= lo) & (v <= hi);
+				}
+			case Bool:
+				return (e.type() == 0x08) & (*e.value() == b);
+			case String:
+				return e.type() == 0x02 && e.string_size() == str.size() &&
+						!std::memcmp(e.string_data(), str.data(), str.size());
+			case Exists:
+				return true;
+			case Missing:
+				return false;
+			}
+			return false;
+		}
+	};
+} // namespace detail
+
+/** @brief A conjunction of simple conditions on dotted paths, to be compiled into a Filter.
+ *
+ * Numeric conditions match int32, int64 and double values alike, other conditions require
+ * the exact type. Conditions other than exists(path, false) never match a missing field.
+ *
+ * Numbers are compared as doubles, so int64 values and integer arguments beyond 2^53 lose
+ * precision: eq(path, int64_t(1) << 60) also matches (1 << 60) + 1.
+ */
+class Query
+{
+	friend class Filter;
+
+	struct Term
+	{
+		std::string path;
+		detail::FilterCondition cond;
+	};
+	std::vector<Term> d_terms;
+
+	Query& add(const std::string& path, detail::FilterCondition::Kind kind,
+			double lo = 0, double hi = 0, bool b = false, const std::string& str = std::string())
+	{
+		d_terms.push_back({ path, { kind, lo, hi, b, str } });
+		return *this;
+	}
+
+	static double inf() { return std::numeric_limits<double>::infinity(); }
+public:
+	Query& eq(const std::string& path, int32_t v) { return range(path, v, v); }
+	Query& eq(const std::string& path, double v) { return range(path, v, v); }
+
+	// int64_t, unsigned and the other integer types, which would be ambiguous otherwise
+	template<typename T>
+	typename std::enable_if<std::is_integral<T>::value, Query&>::type eq(const std::string& path, T v)
+	{
+		return range(path, static_cast<double>(v), static_cast<double>(v));
+	}
+
+	Query& eq(const std::string& path, bool v) { return add(path, detail::FilterCondition::Bool, 0, 0, v); }
+	Query& eq(const std::string& path, const std::string& v) { return add(path, detail::FilterCondition::String, 0, 0, false, v); }
+	Query& eq(const std::string& path, const char *v) { return eq(path, std::string(v)); }
+
+	// inclusive on both ends
+	Query& range(const std::string& path, double lo, double hi) { return add(path, detail::FilterCondition::Numeric, lo, hi); }
+
+	Query& lt(const std::string& path, double v) { return range(path, -inf(), std::nextafter(v, -inf())); }
+	Query& lte(const std::string& path, double v) { return range(path, -inf(), v); }
+	Query& gt(const std::string& path, double v) { return range(path, std::nextafter(v, inf()), inf()); }
+	Query& gte(const std::string& path, double v) { return range(path, v, inf()); }
+
+	Query& exists(const std::string& path, bool ex = true)
+	{
+		return add(path, ex ? detail::FilterCondition::Exists : detail::FilterCondition::Missing);
+	}
+};
+
+/** @brief A Query compiled for evaluation directly on encoded documents.
+ *
+ * Paths are merged into a tree, so every document level is walked at most once no matter
+ * how many conditions refer to it. The walk of a level stops as soon as all the fields
+ * it needs are found, and the whole evaluation stops at the first failed condition.
+ */
+class Filter
+{
+	struct Node
+	{
+		std::string name;
+		std::vector<detail::FilterCondition> conds;
+		std::vector<Node> children;
+	};
+	Node d_root;
+
+	enum { MAX_CHILDREN = 64 };
+
+	static Node& child(Node& node, const std::string& name)
+	{
+		for (auto& c : node.children)
+			if (c.name == name)
+				return c;
+
+		if (node.children.size() == MAX_CHILDREN)
+			throw std::invalid_argument("too many fields referenced in a single document: " + name);
+
+		node.children.push_back(Node());
+		node.children.back().name = name;
+		return node.children.back();
+	}
+
+	static bool match_missing(const Node& node)
+	{
+		for (const auto& c : node.conds)
+			if (c.kind != detail::FilterCondition::Missing)
+				return false;
+		for (const auto& c : node.children)
+			if (!match_missing(c))
+				return false;
+		return true;
+	}
+
+	static bool match_element(const Node& node, const Element& e)
+	{
+		for (const auto& c : node.conds)
+			if (!c.matches(e))
+				return false;
+
+		if (node.children.empty())
+			return true;
+
+		if (e.type() == 0x03 || e.type() == 0x04)
+			return match_doc(node, e.as_document());
+
+		for (const auto& c : node.children)
+			if (!match_missing(c))
+				return false;
+		return true;
+	}
+
+	static bool match_doc(const Node& node, const DocumentView& doc)
+	{
+		const size_t count = node.children.size();
+		const uint64_t all = count == 64 ? ~uint64_t(0) : (uint64_t(1) << count) - 1;
+		uint64_t found = 0;
+
+		for (auto it = doc.begin(), end = doc.end(); it != end && found != all; ++it)
+		{
+			const auto nameSize = it->name_size();
+			for (size_t i = 0; i < count; ++i)
+			{
+				const auto& c = node.children[i];
+				const uint64_t bit = uint64_t(1) << i;
+				if ((found & bit) || c.name.size() != nameSize ||
+						std::memcmp(c.name.data(), it->name(), nameSize))
+					continue;
+
+				if (!match_element(c, *it))
+					return false;
+				found |= bit;
+				break;
+			}
+		}
+
+		for (size_t i = 0; i < count && found != all; ++i)
+			if (!(found & (uint64_t(1) << i)) && !match_missing(node.children[i]))
+				return false;
+		return true;
+	}
+public:
+	/** @brief Compiles \em query.
+	 *
+	 * Throws std::invalid_argument if a single document level is referenced by more than
+	 * 64 distinct field names.
+	 */
+	explicit Filter(const Query& query)
+	{
+		for (const auto& t : query.d_terms)
+		{
+			Node *node = &d_root;
+			size_t start = 0;
+			for (;;)
+			{
+				const auto dot = t.path.find('.', start);
+				node = &child(*node, t.path.substr(start, dot == std::string::npos ? dot : dot - start));
+				if (dot == std::string::npos)
+					break;
+				start = dot + 1;
+			}
+			node->conds.push_back(t.cond);
+		}
+	}
+
+	bool matches(const DocumentView& doc) const
+	{
+		return doc.valid() && match_doc(d_root, doc);
+	}
+
+	/** @brief Appends indices of the matching documents among \em docs to \em selected.
+	 *
+	 * Returns the number of matching documents.
+	 */
+	size_t select(const DocumentView *docs, size_t count, std::vector<uint32_t>& selected) const
+	{
+		const size_t before = selected.size();
+		for (size_t i = 0; i < count; ++i)
+			if (matches(docs[i]))
+				selected.push_back(i);
+		return selected.size() - before;
+	}
+
+	size_t select(const std::vector<DocumentView>& docs, std::vector<uint32_t>& selected) const
+	{
+		return select(docs.empty() ? nullptr : &docs[0], docs.size(), selected);
+	}
+};
+} // namespace ebson11
@@ -0,0 +1,482 @@
+/**********************************************************************
+ * eBSON11 — BSON encoder in C++11.
+ *
+ * Copyright (C) 2013  Georg Rudoy		<georg@barzer.net>
+ * Copyright (C) 2013  Andre Yanpolsky	<andre@barzer.net>
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **********************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <type_traits>
+#include <cerrno>
+#include <climits>
+#include <sys/uio.h>
+#include <poll.h>
+#include "ebson11.h"
+
+namespace ebson11
+{
+namespace detail
+{
+	/** @brief Intrusive multi-producer single-consumer queue (Dmitry Vyukov's design).
+	 *
+	 * push() is wait-free, pop() may only be called from one thread and may return
+	 * nullptr while a concurrent push() is half way through.
+	 */
+	template<typename Node>
+	class mpsc_queue
+	{
+		std::atomic<Node*> m_head;
+		Node *m_tail;
+		Node m_stub;
+	public:
+		mpsc_queue()
+		: m_head(&m_stub)
+		, m_tail(&m_stub)
+		{
+			m_stub.next.store(nullptr);
+		}
+
+		mpsc_queue(const mpsc_queue&) = delete;
+		mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+		void push(Node *n)
+		{
+			n->next.store(nullptr, std::memory_order_relaxed);
+			Node *prev = m_head.exchange(n);
+			prev->next.store(n);
+		}
+
+		Node* pop()
+		{
+			Node *tail = m_tail;
+			Node *next = tail->next.load();
+			if (tail == &m_stub)
+			{
+				if (!next)
+					return nullptr;
+				m_tail = tail = next;
+				next = next->next.load();
+			}
+
+			if (next)
+			{
+				m_tail = next;
+				return tail;
+			}
+
+			if (tail != m_head.load())
+				return nullptr;
+
+			push(&m_stub);
+			next = tail->next.load();
+			if (!next)
+				return nullptr;
+
+			m_tail = next;
+			return tail;
+		}
+	};
+} // namespace detail
+
+/** @brief Collects finalized documents from any number of encoding threads and writes them
+ * to a file descriptor from a single writer thread.
+ *
+ * Producers acquire() a slot, finalize an encoder into the slot buffer (which hands the
+ * slot's previous buffer with its capacity back to the encoder) and push() it. The writer
+ * coalesces queued buffers into writev() calls, flushing once Policy::batchBytes are
+ * pending or the oldest pending document waited for Policy::maxDelay, and recycles the
+ * written slots. push() blocks while more than Policy::maxQueuedBytes are not written yet.
+ *
+ * The descriptor isn't owned by the pipeline. Write errors are counted in Stats and the
+ * failed batch is dropped.
+ */
+template<typename Buf = Encoder::BufType_t>
+class FlushPipelineT
+{
+public:
+	struct Slot
+	{
+		Buf buf;
+	private:
+		friend class FlushPipelineT;
+		friend class detail::mpsc_queue<Slot>;
+
+		std::atomic<Slot*> next { nullptr };
+	};
+
+	struct Policy
+	{
+		size_t batchBytes = 256 * 1024;
+		std::chrono::microseconds maxDelay = std::chrono::milliseconds(5);
+		size_t maxQueuedBytes = 64 * 1024 * 1024;
+	};
+
+	struct Stats
+	{
+		uint64_t docsPushed = 0;
+		uint64_t docsWritten = 0;
+		uint64_t bytesWritten = 0;
+		uint64_t batches = 0;
+		uint64_t writevCalls = 0;
+		uint64_t writeErrors = 0;
+		int lastErrno = 0;
+
+		uint64_t backpressureWaits = 0;		// push() calls which had to wait
+		uint64_t backpressureNanos = 0;		// total time spent waiting there
+		size_t queuedBytes = 0;				// pushed but not written yet
+		size_t maxQueuedBytes = 0;
+	};
+private:
+	const int d_fd;
+	const Policy d_policy;
+
+	detail::mpsc_queue<Slot> d_queue;
+
+	std::mutex d_poolMutex;
+	std::vector<Slot*> d_pool;
+
+	// writer wake-ups
+	std::mutex d_writerMutex;
+	std::condition_variable d_writerCv;
+	std::atomic<bool> d_writerIdle { false };
+	std::atomic<bool> d_flushRequested { false };
+	std::atomic<bool> d_stop { false };
+
+	// producers waiting for the queue to drain
+	std::mutex d_producerMutex;
+	std::condition_variable d_producerCv;
+	std::atomic<size_t> d_queuedBytes { 0 };
+
+	// ever growing, so flush() waits for a fixed target however many pushes follow it
+	std::atomic<uint64_t> d_pushedBytes { 0 };
+	std::atomic<uint64_t> d_retiredBytes { 0 };	// written or dropped on errors
+
+	std::atomic<uint64_t> d_docsPushed { 0 };
+	std::atomic<uint64_t> d_docsWritten { 0 };
+	std::atomic<uint64_t> d_bytesWritten { 0 };
+	std::atomic<uint64_t> d_batches { 0 };
+	std::atomic<uint64_t> d_writevCalls { 0 };
+	std::atomic<uint64_t> d_writeErrors { 0 };
+	std::atomic<int> d_lastErrno { 0 };
+	std::atomic<uint64_t> d_backpressureWaits { 0 };
+	std::atomic<uint64_t> d_backpressureNanos { 0 };
+	std::atomic<size_t> d_maxQueuedBytes { 0 };
+
+	std::thread d_writer;
+
+	// accounts for \em sz more queued bytes unless that exceeds the limit, checking and
+	// adding in one step so concurrent producers can't overshoot it together
+	bool reserve(size_t sz, size_t& queued)
+	{
+		size_t cur = d_queuedBytes.load();
+		do
+		{
+			if (cur && cur + sz > d_policy.maxQueuedBytes)
+				return false;
+		}
+		while (!d_queuedBytes.compare_exchange_weak(cur, cur + sz));
+
+		queued = cur + sz;
+		return true;
+	}
+
+	void wake_writer()
+	{
+		if (d_writerIdle.load())
+		{
+			std::lock_guard<std::mutex> lock(d_writerMutex);
+			d_writerCv.notify_one();
+		}
+	}
+
+	bool write_all(std::vector<iovec>& iov)
+	{
+		size_t pos = 0;
+		while (pos < iov.size())
+		{
+			const int cnt = static_cast<int>(std::min<size_t>(iov.size() - pos, IOV_MAX));
+			const ssize_t written = ::writev(d_fd, &iov[pos], cnt);
+			d_writevCalls.fetch_add(1, std::memory_order_relaxed);
+
+			if (written < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+				{
+					pollfd pfd { d_fd, POLLOUT, 0 };
+					::poll(&pfd, 1, -1);
+					continue;
+				}
+
+				d_lastErrno.store(errno);
+				d_writeErrors.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+
+			d_bytesWritten.fetch_add(written, std::memory_order_relaxed);
+
+			// skipping the written buffers and adjusting the partially written one
+			size_t left = written;
+			while (pos < iov.size() && left >= iov[pos].iov_len)
+				left -= iov[pos++].iov_len;
+			if (left)
+			{
+				iov[pos].iov_base = static_cast<char*>(iov[pos].iov_base) + left;
+				iov[pos].iov_len -= left;
+			}
+		}
+		return true;
+	}
+
+	void write_batch(std::vector<Slot*>& batch, size_t bytes, std::vector<iovec>& iov)
+	{
+		iov.clear();
+		for (auto s : batch)
+			if (s->buf.size())
+				iov.push_back({ &s->buf[0], s->buf.size() });
+
+		if (write_all(iov))
+			d_docsWritten.fetch_add(batch.size(), std::memory_order_relaxed);
+		d_batches.fetch_add(1, std::memory_order_relaxed);
+
+		{
+			std::lock_guard<std::mutex> lock(d_poolMutex);
+			d_pool.insert(d_pool.end(), batch.begin(), batch.end());
+		}
+		batch.clear();
+
+		d_queuedBytes.fetch_sub(bytes);
+		d_retiredBytes.fetch_add(bytes);
+		std::lock_guard<std::mutex> lock(d_producerMutex);
+		d_producerCv.notify_all();
+	}
+
+	void writer_loop()
+	{
+		typedef std::chrono::steady_clock clock;
+
+		std::vector<Slot*> batch;
+		std::vector<iovec> iov;
+		size_t batchBytes = 0;
+		clock::time_point deadline;
+
+		for (;;)
+		{
+			const bool stopping = d_stop.load();
+
+			while (batchBytes < d_policy.batchBytes)
+			{
+				Slot *s = d_queue.pop();
+				if (!s)
+					break;
+
+				if (batch.empty())
+					deadline = clock::now() + d_policy.maxDelay;
+				batch.push_back(s);
+				batchBytes += s->buf.size();
+			}
+
+			if (!batch.empty() &&
+					(batchBytes >= d_policy.batchBytes || stopping ||
+						d_flushRequested.exchange(false) || clock::now() >= deadline))
+			{
+				write_batch(batch, batchBytes, iov);
+				batchBytes = 0;
+				continue;
+			}
+
+			if (stopping && batch.empty())
+			{
+				if (!d_queuedBytes.load())
+					break;
+				std::this_thread::yield();	// a push is half way through
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(d_writerMutex);
+			d_writerIdle.store(true);
+			if (Slot *s = d_queue.pop())
+			{
+				d_writerIdle.store(false);
+				if (batch.empty())
+					deadline = clock::now() + d_policy.maxDelay;
+				batch.push_back(s);
+				batchBytes += s->buf.size();
+				continue;
+			}
+
+			if (batch.empty())
+				d_writerCv.wait_for(lock, std::chrono::milliseconds(100));
+			else
+				d_writerCv.wait_until(lock, deadline);
+			d_writerIdle.store(false);
+		}
+	}
+public:
+	explicit FlushPipelineT(int fd, const Policy& policy = Policy())
+	: d_fd(fd)
+	, d_policy(policy)
+	{
+		d_writer = std::thread([this] { writer_loop(); });
+	}
+
+	FlushPipelineT(const FlushPipelineT&) = delete;
+	FlushPipelineT& operator=(const FlushPipelineT&) = delete;
+
+	/** @brief Writes out everything pushed so far and stops the writer thread.
+	 */
+	~FlushPipelineT()
+	{
+		stop();
+		for (auto s : d_pool)
+			delete s;
+	}
+
+	/** @brief Returns a recycled slot, or a new one if none are available.
+	 */
+	Slot* acquire()
+	{
+		{
+			std::lock_guard<std::mutex> lock(d_poolMutex);
+			if (!d_pool.empty())
+			{
+				Slot *s = d_pool.back();
+				d_pool.pop_back();
+				return s;
+			}
+		}
+		return new Slot;
+	}
+
+	/** @brief Queues the slot for writing, the pipeline takes it over.
+	 *
+	 * Blocks while queuing the slot would take the pipeline over its
+	 * Policy::maxQueuedBytes limit. A single document larger than the limit is still
+	 * accepted once nothing else is queued.
+	 */
+	void push(Slot *s)
+	{
+		const size_t sz = s->buf.size();
+
+		size_t queued;
+		if (!reserve(sz, queued))
+		{
+			const auto start = std::chrono::steady_clock::now();
+			d_flushRequested.store(true);
+			wake_writer();
+			{
+				std::unique_lock<std::mutex> lock(d_producerMutex);
+				d_producerCv.wait(lock, [this, sz, &queued] { return reserve(sz, queued); });
+			}
+			d_backpressureWaits.fetch_add(1, std::memory_order_relaxed);
+			d_backpressureNanos.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+		}
+
+		size_t maxQueued = d_maxQueuedBytes.load(std::memory_order_relaxed);
+		while (queued > maxQueued && !d_maxQueuedBytes.compare_exchange_weak(maxQueued, queued))
+			;
+		d_pushedBytes.fetch_add(sz);
+		d_docsPushed.fetch_add(1);
+
+		d_queue.push(s);
+		wake_writer();
+	}
+
+	/** @brief Finalizes \em enc into a slot and queues it.
+	 *
+	 * The encoder receives a recycled buffer and has to be restart()ed before reuse.
+	 */
+	template<typename Enc>
+	void push(Enc& enc)
+	{
+		static_assert(std::is_same<typename Enc::BufType_t, Buf>::value, "encoder and pipeline buffer types differ");
+
+		Slot *s = acquire();
+		enc.finalize(s->buf);
+		push(s);
+	}
+
+	/** @brief Blocks until everything pushed so far (by any thread) is written.
+	 *
+	 * Documents pushed by other threads while waiting aren't waited for.
+	 */
+	void flush()
+	{
+		const uint64_t target = d_pushedBytes.load();
+		d_flushRequested.store(true);
+		wake_writer();
+
+		std::unique_lock<std::mutex> lock(d_producerMutex);
+		d_producerCv.wait(lock, [this, target] { return d_retiredBytes.load() >= target; });
+	}
+
+	/** @brief Writes out everything pushed so far and stops the writer thread, no more
+	 * pushes are allowed afterwards.
+	 */
+	void stop()
+	{
+		if (!d_writer.joinable())
+			return;
+
+		d_stop.store(true);
+		{
+			std::lock_guard<std::mutex> lock(d_writerMutex);
+			d_writerCv.notify_one();
+		}
+		d_writer.join();
+	}
+
+	Stats stats() const
+	{
+		Stats s;
+		s.docsPushed = d_docsPushed.load(std::memory_order_relaxed);
+		s.docsWritten = d_docsWritten.load(std::memory_order_relaxed);
+		s.bytesWritten = d_bytesWritten.load(std::memory_order_relaxed);
+		s.batches = d_batches.load(std::memory_order_relaxed);
+		s.writevCalls = d_writevCalls.load(std::memory_order_relaxed);
+		s.writeErrors = d_writeErrors.load(std::memory_order_relaxed);
+		s.lastErrno = d_lastErrno.load(std::memory_order_relaxed);
+		s.backpressureWaits = d_backpressureWaits.load(std::memory_order_relaxed);
+		s.backpressureNanos = d_backpressureNanos.load(std::memory_order_relaxed);
+		s.queuedBytes = d_queuedBytes.load(std::memory_order_relaxed);
+		s.maxQueuedBytes = d_maxQueuedBytes.load(std::memory_order_relaxed);
+		return s;
+	}
+};
+
+typedef FlushPipelineT<> FlushPipeline;
+} // namespace ebson11
@@ -0,0 +1,397 @@
+/**********************************************************************
+ * eBSON11 — BSON encoder in C++11.
+ *
+ * Copyright (C) 2013  Georg Rudoy		<georg@barzer.net>
+ * Copyright (C) 2013  Andre Yanpolsky	<andre@barzer.net>
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include <cstring>
+
+#if defined(_MSC_VER) && defined(_M_X64) && !defined(__SIZEOF_INT128__)
+#include <intrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define EBSON11_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define EBSON11_NOINLINE __declspec(noinline)
+#else
+#define EBSON11_NOINLINE
+#endif
+
+namespace ebson11
+{
+struct Digest128
+{
+	uint64_t lo = 0;
+	uint64_t hi = 0;
+
+	bool operator==(const Digest128& other) const { return lo == other.lo && hi == other.hi; }
+	bool operator!=(const Digest128& other) const { return !(*this == other); }
+};
+
+namespace detail
+{
+	constexpr uint64_t POLY_PRIME = (uint64_t(1) << 61) - 1;
+
+	inline uint64_t mod61(uint64_t x)
+	{
+		x = (x & POLY_PRIME) + (x >> 61);
+		return x >= POLY_PRIME ? x - POLY_PRIME : x;
+	}
+
+	/** @brief The full 128-bit product of \em a and \em b, returns the high half.
+	 */
+	inline uint64_t mul128(uint64_t a, uint64_t b, uint64_t& lo)
+	{
+#if defined(__SIZEOF_INT128__)
+		__extension__ typedef unsigned __int128 uint128_t;
+		const uint128_t m = static_cast<uint128_t>(a) * b;
+		lo = static_cast<uint64_t>(m);
+		return static_cast<uint64_t>(m >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+		uint64_t hi;
+		lo = _umul128(a, b, &hi);
+		return hi;
+#else
+		const uint64_t a0 = a & 0xffffffff, a1 = a >> 32;
+		const uint64_t b0 = b & 0xffffffff, b1 = b >> 32;
+
+		const uint64_t p00 = a0 * b0;
+		const uint64_t p01 = a0 * b1;
+		const uint64_t p10 = a1 * b0;
+		const uint64_t mid = (p00 >> 32) + (p01 & 0xffffffff) + (p10 & 0xffffffff);
+
+		lo = (mid << 32) | (p00 & 0xffffffff);
+		return a1 * b1 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+#endif
+	}
+
+	// a and b are below 2^61, so the product is below 2^122 and 2^64 = 8 (mod 2^61-1)
+	inline uint64_t mulmod61(uint64_t a, uint64_t b)
+	{
+		uint64_t lo;
+		const uint64_t hi = mul128(a, b, lo);
+		return mod61((lo & POLY_PRIME) + (lo >> 61) + (hi << 3));
+	}
+
+	inline uint64_t addmod61(uint64_t a, uint64_t b)
+	{
+		const uint64_t r = a + b;
+		return r >= POLY_PRIME ? r - POLY_PRIME : r;
+	}
+
+	inline uint64_t powmod61(uint64_t k, uint64_t e)
+	{
+		uint64_t r = 1;
+		for (; e; e >>= 1)
+		{
+			if (e & 1)
+				r = mulmod61(r, k);
+			k = mulmod61(k, k);
+		}
+		return r;
+	}
+
+	inline uint64_t fmix64(uint64_t k)
+	{
+		k ^= k >> 33;
+		k *= 0xff51afd7ed558ccdULL;
+		k ^= k >> 33;
+		k *= 0xc4ceb9fe1a85ec53ULL;
+		k ^= k >> 33;
+		return k;
+	}
+
+	/** @brief A 128-bit sum of products, reduced modulo 2^61-1 once all are added.
+	 */
+	struct acc128
+	{
+#if defined(__SIZEOF_INT128__)
+		// lets the compiler chain the additions through the carry flag
+		__extension__ typedef unsigned __int128 uint128_t;
+		uint128_t sum = 0;
+
+		void add(uint64_t x) { sum += x; }
+		void mac(uint64_t a, uint64_t b) { sum += static_cast<uint128_t>(a) * b; }
+
+		uint64_t lo() const { return static_cast<uint64_t>(sum); }
+		uint64_t hi() const { return static_cast<uint64_t>(sum >> 64); }
+#else
+		uint64_t d_lo = 0;
+		uint64_t d_hi = 0;
+
+		void add(uint64_t x)
+		{
+			d_lo += x;
+			d_hi += d_lo < x;
+		}
+
+		void mac(uint64_t a, uint64_t b)
+		{
+			uint64_t l;
+			d_hi += mul128(a, b, l);
+			add(l);
+		}
+
+		uint64_t lo() const { return d_lo; }
+		uint64_t hi() const { return d_hi; }
+#endif
+
+		// 2^64 is 8 (mod 2^61-1)
+		uint64_t reduce() const
+		{
+			return mod61(mod61(mod61(hi()) << 3) + (lo() & POLY_PRIME) + (lo() >> 61));
+		}
+	};
+} // namespace detail
+
+/** @brief The default EncoderT hash policy: no hashing at all.
+ */
+struct NoHash
+{
+	enum { enabled = 0 };
+	typedef Digest128 digest_type;
+
+	void reset() {}
+	void update(const uint8_t*, size_t) {}
+	void patch_int32(size_t, int32_t) {}
+	digest_type digest(const uint8_t*, size_t) const { return digest_type(); }
+};
+
+/** @brief Incremental 128-bit hash of a buffer being appended to.
+ *
+ * Streaming hashes like xxHash can't take back bytes they've already consumed, while the
+ * encoder writes document sizes into placeholders long after the following bytes were
+ * appended. So this is a pair of polynomial hashes modulo 2^61-1, evaluated with Horner's
+ * rule over 64-byte blocks: being linear, a placeholder that has already been folded is
+ * fixed up by adding its change times the weight of its position, looked up in tables of
+ * key powers.
+ *
+ * Each 64-bit little-endian word contributes its low 61 bits as one limb, and the top 3
+ * bits of all the words of a block are packed into one more limb. Limbs are below the
+ * modulus, so distinct buffers of the same length only collide through the polynomials
+ * themselves, never through the reduction of the input. The products of a block are
+ * summed in 128 bits and reduced once, so a block costs one multiplication per word and
+ * lane.
+ *
+ * update() folds the complete blocks of the buffer, except for the last LAG ones, once
+ * there are BATCH of them: they are hashed while still in cache, and most placeholders
+ * are filled before their bytes get folded, so they cost nothing. patch_int32() records
+ * an int32 written over zeroes at the given offset, and digest() folds the rest and
+ * mixes in the length. The result depends only on the final bytes, so hashing an
+ * encoder buffer incrementally yields the same digest as hash_bytes() over it.
+ */
+class PolyHash
+{
+	enum { WORDS = 8, BLOCK = WORDS * 8, LANES = 2, TABLE = 64 };
+
+	// blocks left unfolded behind the end, and the least number of blocks folded at once
+	enum { LAG = 16, BATCH = 16 };
+
+	// k^0 .. k^(WORDS + 1) of each lane
+	static const uint64_t* powers(int lane)
+	{
+		static const uint64_t p[LANES][WORDS + 2] =
+		{
+			{
+				0x0000000000000001ULL, 0x1bd11bdaa9fc1a22ULL, 0x0f70b62148ff9abcULL,
+				0x154fc1f24f3fd360ULL, 0x0aad32758a181956ULL, 0x13ae086153d21895ULL,
+				0x0d5c4b3733ac7b53ULL, 0x0e9c475891758038ULL, 0x0836a724d7671c93ULL,
+				0x08abab713ba5aba3ULL
+			},
+			{
+				0x0000000000000001ULL, 0x0a5a3c9e2b7f4d61ULL, 0x045a6360bb59ec1cULL,
+				0x12af9b129820bcfdULL, 0x1d72d3af50cfa38bULL, 0x099a58e3900c4e48ULL,
+				0x04ab285030c57944ULL, 0x05ab312de4d5402fULL, 0x1de0e4623f302781ULL,
+				0x0441abda146d73e9ULL
+			}
+		};
+		return p[lane];
+	}
+
+	// powers of k^(WORDS + 1), the factor a folded block gets from every following one
+	struct BlockPowers
+	{
+		uint64_t low[LANES][TABLE];		// k^((WORDS + 1) * i)
+		uint64_t high[LANES][TABLE];	// k^((WORDS + 1) * TABLE * i)
+
+		BlockPowers()
+		{
+			for (int lane = 0; lane < LANES; ++lane)
+			{
+				low[lane][0] = high[lane][0] = 1;
+				for (int i = 1; i < TABLE; ++i)
+					low[lane][i] = detail::mulmod61(low[lane][i - 1], powers(lane)[WORDS + 1]);
+				const uint64_t step = detail::mulmod61(low[lane][TABLE - 1], powers(lane)[WORDS + 1]);
+				for (int i = 1; i < TABLE; ++i)
+					high[lane][i] = detail::mulmod61(high[lane][i - 1], step);
+			}
+		}
+	};
+
+	static uint64_t block_power(int lane, size_t n)
+	{
+		static const BlockPowers tables;
+		if (n < TABLE * TABLE)
+			return detail::mulmod61(tables.low[lane][n % TABLE], tables.high[lane][n / TABLE]);
+		return detail::powmod61(powers(lane)[WORDS + 1], n);
+	}
+
+	uint64_t d_h[LANES];
+	size_t d_folded;	// bytes folded into d_h, always a multiple of BLOCK
+
+	// h = h * k^(n + 1) + sum(low61(x[j]) * k^(n - j)) + top3(x[0 .. n)) for n <= WORDS
+	static void step(uint64_t *h, const uint64_t *x, int n)
+	{
+		detail::acc128 sum[LANES];
+
+		uint64_t top = 0;
+		for (int j = 0; j < n; ++j)
+		{
+			const uint64_t limb = x[j] & detail::POLY_PRIME;
+			top |= (x[j] >> 61) << (3 * j);
+			for (int lane = 0; lane < LANES; ++lane)
+				sum[lane].mac(limb, powers(lane)[n - j]);
+		}
+
+		for (int lane = 0; lane < LANES; ++lane)
+		{
+			sum[lane].add(top);
+			sum[lane].mac(h[lane], powers(lane)[n + 1]);
+			h[lane] = sum[lane].reduce();
+		}
+	}
+
+	// kept out of line, so that the updates inlined into the encoder stay small
+	static EBSON11_NOINLINE void fold(uint64_t *state, const uint8_t *p, size_t blocks)
+	{
+		// a local copy, as the data could alias the state
+		uint64_t h[LANES] = { state[0], state[1] };
+		for (; blocks; --blocks, p += BLOCK)
+		{
+			uint64_t x[WORDS];
+			std::memcpy(x, p, BLOCK);
+			step(h, x, WORDS);
+		}
+		state[0] = h[0];
+		state[1] = h[1];
+	}
+
+	// adds the change \em delta of a word which was folded with zeroes in place of its bits
+	void patch_word(size_t word, uint64_t delta)
+	{
+		const size_t block = word / WORDS;
+		const size_t folded = d_folded / BLOCK;
+		if (!delta || block >= folded)
+			return;
+
+		const size_t j = word % WORDS;
+		const uint64_t limb = delta & detail::POLY_PRIME;
+		const uint64_t top = (delta >> 61) << (3 * j);
+		for (int lane = 0; lane < LANES; ++lane)
+		{
+			const uint64_t change = detail::addmod61(detail::mulmod61(limb, powers(lane)[WORDS - j]), top);
+			d_h[lane] = detail::addmod61(d_h[lane],
+					detail::mulmod61(change, block_power(lane, folded - 1 - block)));
+		}
+	}
+
+	EBSON11_NOINLINE void patch_folded(size_t offset, int32_t value)
+	{
+		const uint64_t v = static_cast<uint32_t>(value);
+		const size_t shift = offset % 8;
+
+		patch_word(offset / 8, v << (8 * shift));
+		if (shift > 4)
+			patch_word(offset / 8 + 1, v >> (8 * (8 - shift)));
+	}
+public:
+	enum { enabled = 1 };
+	typedef Digest128 digest_type;
+
+	PolyHash() { reset(); }
+
+	void reset()
+	{
+		d_h[0] = d_h[1] = 0;
+		d_folded = 0;
+	}
+
+	void update(const uint8_t *data, size_t size)
+	{
+		if (size < d_folded + BLOCK * (LAG + BATCH))
+			return;
+
+		const size_t blocks = (size - d_folded) / BLOCK - LAG;
+		fold(d_h, data + d_folded, blocks);
+		d_folded += blocks * BLOCK;
+	}
+
+	void patch_int32(size_t offset, int32_t value)
+	{
+		// the bytes are going to be folded with the value already written
+		if (offset >= d_folded)
+			return;
+		patch_folded(offset, value);
+	}
+
+	digest_type digest(const uint8_t *data, size_t size) const
+	{
+		uint64_t h[LANES] = { d_h[0], d_h[1] };
+
+		const size_t blocks = (size - d_folded) / BLOCK;
+		fold(h, data + d_folded, blocks);
+
+		// the tail is folded as a shorter block, its last word zero padded
+		const size_t done = d_folded + blocks * BLOCK;
+		if (size > done)
+		{
+			uint64_t x[WORDS] = { 0 };
+			std::memcpy(x, data + done, size - done);
+			step(h, x, static_cast<int>((size - done + 7) / 8));
+		}
+
+		digest_type d;
+		d.lo = detail::fmix64(h[0] ^ detail::fmix64(size));
+		d.hi = detail::fmix64(h[1] + d.lo);
+		return d;
+	}
+};
+
+/** @brief Hashes an existing buffer, the result matches the one of an encoder using
+ * PolyHash which produced the same bytes.
+ */
+inline Digest128 hash_bytes(const void *data, size_t size)
+{
+	return PolyHash().digest(static_cast<const uint8_t*>(data), size);
+}
+} // namespace ebson11
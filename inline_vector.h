@@ -0,0 +1,234 @@
+/**********************************************************************
+ * eBSON11 — BSON encoder in C++11.
+ *
+ * Copyright (C) 2013  Georg Rudoy		<georg@barzer.net>
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **********************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <cstring>
+#include <cstddef>
+#include <stdint.h>
+
+namespace ebson11
+{
+namespace detail
+{
+	/** @brief An uninit_vector with room for \em N elements inside the object itself.
+	 *
+	 * The heap is only touched once the vector grows beyond \em N elements, so an encoder
+	 * using it for small documents doesn't allocate at all. Just like uninit_vector it
+	 * doesn't initialize its elements and copies them with memcpy.
+	 *
+	 * @note This vector should be only used with trivially copyable types.
+	 */
+	template<typename T, size_t N>
+	class inline_vector
+	{
+		static_assert(N > 0, "inline capacity should be positive");
+
+		T *m_data;
+		size_t m_capacity = N;
+		size_t m_size = 0;
+		typename std::aligned_storage<sizeof(T) * N, alignof(T)>::type m_inline;
+
+		T* inline_data() { return reinterpret_cast<T*>(&m_inline); }
+		bool is_inline() const { return m_data == reinterpret_cast<const T*>(&m_inline); }
+
+		void release()
+		{
+			if (!is_inline())
+				::operator delete(m_data);
+		}
+
+		// takes over the contents of \em other leaving it empty, *this should be empty
+		void take(inline_vector& other)
+		{
+			if (other.is_inline())
+			{
+				std::memcpy(m_data, other.m_data, other.m_size * sizeof(T));
+				m_size = other.m_size;
+			}
+			else
+			{
+				release();
+				m_data = other.m_data;
+				m_capacity = other.m_capacity;
+				m_size = other.m_size;
+
+				other.m_data = other.inline_data();
+				other.m_capacity = N;
+			}
+			other.m_size = 0;
+		}
+	public:
+		typedef T value_type;
+
+		inline_vector() : m_data(inline_data()) {}
+		~inline_vector() { release(); }
+
+		inline_vector(const inline_vector& other)
+		: m_data(inline_data())
+		{
+			*this = other;
+		}
+
+		inline_vector(inline_vector&& other)
+		: m_data(inline_data())
+		{
+			take(other);
+		}
+
+		inline_vector& operator=(const inline_vector& other)
+		{
+			if (this != &other)
+			{
+				resize(other.m_size);
+				std::memcpy(m_data, other.m_data, other.m_size * sizeof(T));
+			}
+			return *this;
+		}
+
+		inline_vector& operator=(inline_vector&& other)
+		{
+			swap(other);
+			return *this;
+		}
+
+		const T* begin() const { return m_data; }
+		const T* end() const { return m_data + m_size; }
+
+		void swap(inline_vector& other)
+		{
+			if (!is_inline() && !other.is_inline())
+			{
+				std::swap(other.m_data, m_data);
+				std::swap(other.m_capacity, m_capacity);
+				std::swap(other.m_size, m_size);
+				return;
+			}
+
+			inline_vector tmp;
+			tmp.take(other);
+			other.take(*this);
+			take(tmp);
+		}
+
+		void reserve(size_t capacity)
+		{
+			if (capacity <= m_capacity)
+				return;
+
+			T *data = static_cast<T*>(::operator new(capacity * sizeof(T)));
+			std::memcpy(data, m_data, m_size * sizeof(T));
+			release();
+
+			m_data = data;
+			m_capacity = capacity;
+		}
+
+		void resize(size_t size)
+		{
+			if (size > m_capacity)
+				reserve(std::max(size, m_capacity * 2));
+			m_size = size;
+		}
+
+		void clear() { m_size = 0; }
+
+		void push_back(const T& t)
+		{
+			if (m_size == m_capacity)
+				reserve(m_capacity * 2);
+
+			m_data[m_size++] = t;
+		}
+
+		const T& operator[](size_t p) const { return m_data[p]; }
+		T& operator[](size_t p) { return m_data[p]; }
+
+		const T& back() const { return m_data[m_size - 1]; }
+		T& back() { return m_data[m_size - 1]; }
+
+		size_t size() const { return m_size; }
+		size_t capacity() const { return m_capacity; }
+		bool empty() const { return !m_size; }
+
+		std::vector<T> to_std_vector() const
+		{
+			return std::vector<T>(begin(), end());
+		}
+
+		bool operator==(const inline_vector& other) const
+		{
+			return m_size == other.m_size &&
+					!memcmp(m_data, other.m_data, m_size * sizeof(T));
+		}
+
+		bool operator==(const std::vector<T>& other) const
+		{
+			return m_size == other.size() &&
+					!memcmp(m_data, other.data(), m_size * sizeof(T));
+		}
+
+		template<typename U>
+		bool operator!=(const U& other) const
+		{
+			return !(*this == other);
+		}
+	};
+
+	/** @brief Adapts inline_vector to the vector template signature EncoderT expects.
+	 *
+	 * EncoderT<inline_storage<256>::vector> keeps up to 256 bytes of the document inline.
+	 */
+	template<size_t N>
+	struct inline_storage
+	{
+		template<typename T, typename Alloc = std::allocator<T>>
+		using vector = inline_vector<T, N>;
+	};
+
+	// how much an encoder reserves in its buffer by default
+	template<typename Buf>
+	struct default_reserve
+	{
+		enum { value = 1024*64 };
+	};
+
+	template<typename T, size_t N>
+	struct default_reserve<inline_vector<T, N>>
+	{
+		enum { value = N };
+	};
+}
+}
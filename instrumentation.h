@@ -0,0 +1,289 @@
+/**********************************************************************
+ * eBSON11 — BSON encoder in C++11.
+ *
+ * Copyright (C) 2013  Georg Rudoy		<georg@barzer.net>
+ * Copyright (C) 2013  Andre Yanpolsky	<andre@barzer.net>
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <ostream>
+#include <algorithm>
+
+namespace ebson11
+{
+/** @brief The default EncoderT instrumentation policy: does nothing and compiles away.
+ */
+struct NoInstrumentation
+{
+	enum { enabled = 0 };
+
+	struct timer {};
+
+	static void on_value(uint8_t, size_t) {}
+	static void on_depth(size_t) {}
+	static void on_growth(size_t, size_t) {}
+	static timer finalize_begin() { return timer(); }
+	static void finalize_end(const timer&, size_t) {}
+};
+
+/** @brief A snapshot of the counters gathered by CountingInstrumentation.
+ *
+ * Counters are cumulative since the start of the process, subtract two snapshots to get
+ * the numbers for a period.
+ */
+struct EncoderStats
+{
+	enum { MAX_DEPTH = 32 };
+
+	uint64_t calls[256] = {};	// values encoded, by BSON type id (0x03/0x04 are document starts)
+	uint64_t bytes[256] = {};	// bytes appended for them, including the type and the name
+	uint64_t depth[MAX_DEPTH + 1] = {};	// documents opened at each depth, the root being 1,
+										// deeper ones are counted in the last bucket
+	uint64_t growths = 0;		// buffer reallocations
+	uint64_t grownBytes = 0;	// capacity added by them
+	uint64_t finalizes = 0;
+	uint64_t finalizeNanos = 0;
+	uint64_t finalizedBytes = 0;
+
+	EncoderStats& operator+=(const EncoderStats& other)
+	{
+		for (size_t i = 0; i < 256; ++i)
+		{
+			calls[i] += other.calls[i];
+			bytes[i] += other.bytes[i];
+		}
+		for (size_t i = 0; i <= MAX_DEPTH; ++i)
+			depth[i] += other.depth[i];
+		growths += other.growths;
+		grownBytes += other.grownBytes;
+		finalizes += other.finalizes;
+		finalizeNanos += other.finalizeNanos;
+		finalizedBytes += other.finalizedBytes;
+		return *this;
+	}
+
+	EncoderStats& operator-=(const EncoderStats& other)
+	{
+		for (size_t i = 0; i < 256; ++i)
+		{
+			calls[i] -= other.calls[i];
+			bytes[i] -= other.bytes[i];
+		}
+		for (size_t i = 0; i <= MAX_DEPTH; ++i)
+			depth[i] -= other.depth[i];
+		growths -= other.growths;
+		grownBytes -= other.grownBytes;
+		finalizes -= other.finalizes;
+		finalizeNanos -= other.finalizeNanos;
+		finalizedBytes -= other.finalizedBytes;
+		return *this;
+	}
+
+	// one "name value" pair per line, zero counters are skipped
+	void print(std::ostream& ostr) const
+	{
+		const char *hex = "0123456789abcdef";
+		for (size_t i = 0; i < 256; ++i)
+			if (calls[i])
+			{
+				const char id[] = { '0', 'x', hex[i >> 4], hex[i & 15], 0 };
+				ostr << "type." << id << ".calls " << calls[i] << '\n';
+				ostr << "type." << id << ".bytes " << bytes[i] << '\n';
+			}
+		for (size_t i = 0; i <= MAX_DEPTH; ++i)
+			if (depth[i])
+				ostr << "depth." << i << (i == MAX_DEPTH ? "+ " : " ") << depth[i] << '\n';
+		ostr << "growths " << growths << '\n';
+		ostr << "grown_bytes " << grownBytes << '\n';
+		ostr << "finalizes " << finalizes << '\n';
+		ostr << "finalize_ns " << finalizeNanos << '\n';
+		ostr << "finalized_bytes " << finalizedBytes << '\n';
+	}
+};
+
+namespace detail
+{
+	/** @brief Per-thread counters, registered globally for snapshots.
+	 *
+	 * Only the owning thread writes them, so increments are plain relaxed load/store
+	 * pairs without any read-modify-write.
+	 */
+	class encoder_thread_counters
+	{
+		typedef std::atomic<uint64_t> counter_t;
+
+		struct registry
+		{
+			std::mutex mutex;
+			std::vector<encoder_thread_counters*> live;
+			EncoderStats retired;	// counters of the threads which have exited
+		};
+
+		static registry& get_registry()
+		{
+			static registry r;
+			return r;
+		}
+
+		static void add(counter_t& c, uint64_t v)
+		{
+			c.store(c.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+		}
+	public:
+		counter_t calls[256];
+		counter_t bytes[256];
+		counter_t depth[EncoderStats::MAX_DEPTH + 1];
+		counter_t growths;
+		counter_t grownBytes;
+		counter_t finalizes;
+		counter_t finalizeNanos;
+		counter_t finalizedBytes;
+
+		encoder_thread_counters()
+		{
+			for (auto& c : calls)
+				c.store(0);
+			for (auto& c : bytes)
+				c.store(0);
+			for (auto& c : depth)
+				c.store(0);
+			growths.store(0);
+			grownBytes.store(0);
+			finalizes.store(0);
+			finalizeNanos.store(0);
+			finalizedBytes.store(0);
+
+			auto& r = get_registry();
+			std::lock_guard<std::mutex> lock(r.mutex);
+			r.live.push_back(this);
+		}
+
+		~encoder_thread_counters()
+		{
+			auto& r = get_registry();
+			std::lock_guard<std::mutex> lock(r.mutex);
+			r.live.erase(std::find(r.live.begin(), r.live.end(), this));
+			r.retired += load();
+		}
+
+		encoder_thread_counters(const encoder_thread_counters&) = delete;
+		encoder_thread_counters& operator=(const encoder_thread_counters&) = delete;
+
+		static encoder_thread_counters& local()
+		{
+			static thread_local encoder_thread_counters counters;
+			return counters;
+		}
+
+		void on_value(uint8_t type, size_t sz)
+		{
+			add(calls[type], 1);
+			add(bytes[type], sz);
+		}
+
+		void on_depth(size_t d)
+		{
+			add(depth[std::min<size_t>(d, EncoderStats::MAX_DEPTH)], 1);
+		}
+
+		void on_growth(size_t oldCap, size_t newCap)
+		{
+			add(growths, 1);
+			add(grownBytes, newCap - oldCap);
+		}
+
+		void on_finalize(uint64_t nanos, size_t sz)
+		{
+			add(finalizes, 1);
+			add(finalizeNanos, nanos);
+			add(finalizedBytes, sz);
+		}
+
+		EncoderStats load() const
+		{
+			EncoderStats s;
+			for (size_t i = 0; i < 256; ++i)
+			{
+				s.calls[i] = calls[i].load(std::memory_order_relaxed);
+				s.bytes[i] = bytes[i].load(std::memory_order_relaxed);
+			}
+			for (size_t i = 0; i <= EncoderStats::MAX_DEPTH; ++i)
+				s.depth[i] = depth[i].load(std::memory_order_relaxed);
+			s.growths = growths.load(std::memory_order_relaxed);
+			s.grownBytes = grownBytes.load(std::memory_order_relaxed);
+			s.finalizes = finalizes.load(std::memory_order_relaxed);
+			s.finalizeNanos = finalizeNanos.load(std::memory_order_relaxed);
+			s.finalizedBytes = finalizedBytes.load(std::memory_order_relaxed);
+			return s;
+		}
+
+		static EncoderStats snapshot()
+		{
+			auto& r = get_registry();
+			std::lock_guard<std::mutex> lock(r.mutex);
+
+			EncoderStats s = r.retired;
+			for (auto c : r.live)
+				s += c->load();
+			return s;
+		}
+	};
+} // namespace detail
+
+/** @brief EncoderT instrumentation policy counting values and bytes per BSON type, the
+ * document nesting depth histogram, buffer growths and finalize() timings.
+ *
+ * Counters are thread-local, snapshot() sums them over all the threads (including the
+ * ones which have exited) on demand.
+ */
+struct CountingInstrumentation
+{
+	enum { enabled = 1 };
+
+	typedef std::chrono::steady_clock::time_point timer;
+
+	static void on_value(uint8_t type, size_t sz) { detail::encoder_thread_counters::local().on_value(type, sz); }
+	static void on_depth(size_t d) { detail::encoder_thread_counters::local().on_depth(d); }
+	static void on_growth(size_t oldCap, size_t newCap) { detail::encoder_thread_counters::local().on_growth(oldCap, newCap); }
+
+	static timer finalize_begin() { return std::chrono::steady_clock::now(); }
+
+	static void finalize_end(const timer& start, size_t sz)
+	{
+		const auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		detail::encoder_thread_counters::local().on_finalize(nanos, sz);
+	}
+
+	static EncoderStats snapshot() { return detail::encoder_thread_counters::snapshot(); }
+};
+} // namespace ebson11
@@ -0,0 +1,133 @@
+/**********************************************************************
+ * eBSON11 — BSON encoder in C++11.
+ *
+ * Copyright (C) 2013  Georg Rudoy		<georg@barzer.net>
+ * Copyright (C) 2013  Andre Yanpolsky	<andre@barzer.net>
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **********************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cstring>
+
+namespace ebson11
+{
+/** @brief The 12 bytes of a BSON ObjectId: big-endian seconds since the epoch, a 5 byte
+ * random value and a 3 byte big-endian counter.
+ */
+struct ObjectId
+{
+	uint8_t bytes[12];
+
+	bool operator==(const ObjectId& other) const { return !std::memcmp(bytes, other.bytes, sizeof(bytes)); }
+	bool operator!=(const ObjectId& other) const { return !(*this == other); }
+	bool operator<(const ObjectId& other) const { return std::memcmp(bytes, other.bytes, sizeof(bytes)) < 0; }
+
+	/** @brief Generates a new id.
+	 *
+	 * Each thread has its own counter and its own 5 byte value derived from a random
+	 * number obtained once per process, so generation takes no locks and makes no
+	 * syscalls besides reading the (vDSO) clock. Threads get distinct 5 byte values, and
+	 * a thread switches to a fresh one whenever its counter wraps, so ids don't repeat
+	 * within a process even at more than 2^24 ids per second per thread.
+	 *
+	 * @note The random value isn't refreshed on fork(), a forked child generating ids
+	 * concurrently with its parent may collide with it.
+	 */
+	static ObjectId generate();
+};
+
+namespace detail
+{
+	class objectid_thread_state
+	{
+		uint64_t m_discriminator;	// lower 40 bits are used
+		uint32_t m_counter;
+		uint32_t m_counterStart;
+
+		static uint64_t process_random()
+		{
+			static const uint64_t r = []
+			{
+				std::random_device rd;
+				return (static_cast<uint64_t>(rd()) << 32) ^ rd();
+			}();
+			return r;
+		}
+
+		void renew()
+		{
+			static std::atomic<uint64_t> ordinal { 0 };
+
+			const uint64_t r = process_random();
+			const uint64_t n = ordinal.fetch_add(1, std::memory_order_relaxed);
+
+			// an odd multiplier keeps the values distinct modulo 2^40 for distinct ordinals
+			m_discriminator = (r + n * 0x9e3779b97f4a7c15ULL) & 0xffffffffffULL;
+			m_counterStart = m_counter = static_cast<uint32_t>((r >> 40) ^ (n * 0x2545f491)) & 0xffffff;
+		}
+	public:
+		objectid_thread_state() { renew(); }
+
+		void fill(ObjectId& oid)
+		{
+			const uint32_t secs = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(
+					std::chrono::system_clock::now().time_since_epoch()).count());
+
+			m_counter = (m_counter + 1) & 0xffffff;
+			if (m_counter == m_counterStart)
+				renew();
+
+			uint8_t *b = oid.bytes;
+			b[0] = secs >> 24;
+			b[1] = secs >> 16;
+			b[2] = secs >> 8;
+			b[3] = secs;
+			b[4] = m_discriminator >> 32;
+			b[5] = m_discriminator >> 24;
+			b[6] = m_discriminator >> 16;
+			b[7] = m_discriminator >> 8;
+			b[8] = m_discriminator;
+			b[9] = m_counter >> 16;
+			b[10] = m_counter >> 8;
+			b[11] = m_counter;
+		}
+	};
+} // namespace detail
+
+inline ObjectId ObjectId::generate()
+{
+	static thread_local detail::objectid_thread_state state;
+
+	ObjectId oid;
+	state.fill(oid);
+	return oid;
+}
+} // namespace ebson11
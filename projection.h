@@ -0,0 +1,331 @@
+/**********************************************************************
+ * eBSON11 — BSON encoder in C++11.
+ *
+ * Copyright (C) 2013  Georg Rudoy		<georg@barzer.net>
+ * Copyright (C) 2013  Andre Yanpolsky	<andre@barzer.net>
+ *
+ * Boost Software License - Version 1.0 - August 17th, 2003
+ *
+ * Permission is hereby granted, free of charge, to any person or organization
+ * obtaining a copy of the software and accompanying documentation covered by
+ * this license (the "Software") to use, reproduce, display, distribute,
+ * execute, and transmit the Software, and to prepare derivative works of the
+ * Software, and to permit third-parties to whom the Software is furnished to
+ * do so, all subject to the following:
+ *
+ * The copyright notices in the Software and this entire statement, including
+ * the above license grant, this restriction and the following disclaimer,
+ * must be included in all copies of the Software, in whole or in part, and
+ * all derivative works of the Software, unless such copies or derivative
+ * works are solely in the form of machine-executable object code generated by
+ * a source language processor.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, TITLE AND NON-INFRINGEMENT. IN NO EVENT
+ * SHALL THE COPYRIGHT HOLDERS OR ANYONE DISTRIBUTING THE SOFTWARE BE LIABLE
+ * FOR ANY DAMAGES OR OTHER LIABILITY, WHETHER IN CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ **********************************************************************/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include "bsonreader.h"
+
+namespace ebson11
+{
+enum class ColumnType
+{
+	Int32,		// int32 values only
+	Double,		// double, int32 and int64 values, widened to double
+	String
+};
+
+/** @brief Struct-of-arrays output of a Projection for one path.
+ *
+ * Only the arrays matching the column type are filled. Bit i of \em validity is set if
+ * document i had a value of a matching type at the path, missing values are zeroes
+ * (or empty strings).
+ *
+ * String i occupies bytes [offsets[i], offsets[i + 1]) of \em bytes, no terminating
+ * zeroes are stored.
+ */
+struct Column
+{
+	std::string path;
+	ColumnType type = ColumnType::Int32;
+
+	std::vector<int32_t> ints;
+	std::vector<double> doubles;
+	std::vector<uint64_t> offsets;
+	std::vector<char> bytes;
+	std::vector<uint8_t> validity;
+
+	bool is_valid(size_t i) const { return validity[i >> 3] & (1 << (i & 7)); }
+};
+
+/** @brief Extracts a set of dotted paths from a batch of documents into Columns.
+ *
+ * While walking a batch each worker remembers where every path component was found in
+ * the previous document. A lookup steps over the elements up to that position and takes
+ * the element there if it has the exact key, otherwise it falls back to the linear scan
+ * from the start. Either way it costs about as much as DocumentView::find(): the hint
+ * only keeps the keys before it from being compared.
+ */
+class Projection
+{
+	struct PathSpec
+	{
+		std::string path;
+		ColumnType type;
+		std::vector<std::string> components;
+	};
+	std::vector<PathSpec> d_paths;
+
+	// documents per worker chunk are a multiple of this to keep validity bytes unshared
+	enum { CHUNK_ALIGN = 64 };
+
+	struct Worker
+	{
+		const Projection& d_proj;
+		std::vector<std::vector<size_t>> d_hints;	// per path, per component
+		std::vector<std::vector<uint64_t>> d_strLens;	// per path, string columns only
+		std::vector<std::vector<char>> d_strBytes;
+
+		explicit Worker(const Projection& proj)
+		: d_proj(proj)
+		, d_hints(proj.d_paths.size())
+		, d_strLens(proj.d_paths.size())
+		, d_strBytes(proj.d_paths.size())
+		{
+			for (size_t i = 0; i < d_hints.size(); ++i)
+				d_hints[i].resize(proj.d_paths[i].components.size(), 0);
+		}
+
+		Element lookup(DocumentView doc, size_t pathIdx)
+		{
+			const auto& comps = d_proj.d_paths[pathIdx].components;
+			auto& hints = d_hints[pathIdx];
+
+			Element e;
+			for (size_t c = 0; c < comps.size(); ++c)
+			{
+				if (c)
+				{
+					if (e.type() != 0x03 && e.type() != 0x04)
+						return Element();
+					doc = e.as_document();
+				}
+
+				e = find_hinted(doc, comps[c], hints[c]);
+				if (!e)
+					return e;
+			}
+			return e;
+		}
+
+		static bool has_name(const Element& e, const std::string& name)
+		{
+			return e.name_size() == name.size() && !std::memcmp(e.name(), name.data(), name.size());
+		}
+
+		// a single walk over doc if the element at hint still has the name, the elements
+		// before it are only stepped over
+		static Element find_hinted(DocumentView doc, const std::string& name, size_t& hint)
+		{
+			const uint8_t *target = doc.data() + hint;
+			auto it = doc.begin();
+			const auto last = doc.end();
+			while (it != last && it->raw() < target)
+				++it;
+			if (it != last && it->raw() == target && has_name(*it, name))
+				return *it;
+
+			for (auto e = doc.begin(); e != last; ++e)
+				if (has_name(*e, name))
+				{
+					hint = e->raw() - doc.data();
+					return *e;
+				}
+			return Element();
+		}
+
+		void run(const DocumentView *docs, size_t begin, size_t end, std::vector<Column>& out)
+		{
+			for (size_t i = begin; i < end; ++i)
+				for (size_t p = 0; p < out.size(); ++p)
+				{
+					auto& col = out[p];
+					const Element e = docs[i].valid() ? lookup(docs[i], p) : Element();
+
+					bool valid = false;
+					switch (col.type)
+					{
+					case ColumnType::Int32:
+						if (e && e.type() == 0x10)
+						{
+							col.ints[i] = e.as_int32();
+							valid = true;
+						}
+						break;
+					case ColumnType::Double:
+						if (e)
+						{
+							valid = true;
+							switch (e.type())
+							{
+							case 0x01:
+								col.doubles[i] = e.as_double();
+								break;
+							case 0x10:
+								col.doubles[i] = e.as_int32();
+								break;
+							case 0x12:
+								col.doubles[i] = e.as_int64();
+								break;
+							default:
+								valid = false;
+							}
+						}
+						break;
+					case ColumnType::String:
+						if (e && e.type() == 0x02)
+						{
+							auto& bytes = d_strBytes[p];
+							bytes.insert(bytes.end(), e.string_data(), e.string_data() + e.string_size());
+							d_strLens[p].push_back(e.string_size());
+							valid = true;
+						}
+						else
+							d_strLens[p].push_back(0);
+						break;
+					}
+
+					if (valid)
+						col.validity[i >> 3] |= 1 << (i & 7);
+				}
+		}
+	};
+public:
+	/** @brief Adds a column for the dotted \em path and returns its index in the output.
+	 */
+	size_t add_column(const std::string& path, ColumnType type)
+	{
+		PathSpec spec { path, type, {} };
+
+		size_t start = 0;
+		for (;;)
+		{
+			const auto dot = path.find('.', start);
+			spec.components.push_back(path.substr(start, dot == std::string::npos ? dot : dot - start));
+			if (dot == std::string::npos)
+				break;
+			start = dot + 1;
+		}
+
+		d_paths.push_back(spec);
+		return d_paths.size() - 1;
+	}
+
+	size_t columns_count() const { return d_paths.size(); }
+
+	/** @brief Projects \em count documents into \em out, one Column per added path.
+	 *
+	 * The batch is split into contiguous chunks processed by up to \em threads threads.
+	 * Invalid document views yield rows with all values missing.
+	 */
+	void run(const DocumentView *docs, size_t count, std::vector<Column>& out, size_t threads = 1) const
+	{
+		out.resize(d_paths.size());
+		for (size_t p = 0; p < d_paths.size(); ++p)
+		{
+			auto& col = out[p];
+			col.path = d_paths[p].path;
+			col.type = d_paths[p].type;
+
+			col.ints.clear();
+			col.doubles.clear();
+			col.offsets.clear();
+			col.bytes.clear();
+			col.validity.assign((count + 7) / 8, 0);
+
+			switch (col.type)
+			{
+			case ColumnType::Int32:
+				col.ints.resize(count);
+				break;
+			case ColumnType::Double:
+				col.doubles.resize(count);
+				break;
+			case ColumnType::String:
+				col.offsets.resize(count + 1);
+				break;
+			}
+		}
+
+		if (!threads)
+			threads = 1;
+		size_t chunk = (count + threads - 1) / threads;
+		chunk = (chunk + CHUNK_ALIGN - 1) / CHUNK_ALIGN * CHUNK_ALIGN;
+		if (!chunk)
+			chunk = CHUNK_ALIGN;
+
+		std::vector<Worker> workers;
+		for (size_t begin = 0; begin < count; begin += chunk)
+			workers.emplace_back(*this);
+
+		if (workers.size() <= 1)
+		{
+			if (!workers.empty())
+				workers.front().run(docs, 0, count, out);
+		}
+		else
+		{
+			std::vector<std::thread> pool;
+			for (size_t w = 0; w < workers.size(); ++w)
+			{
+				const size_t begin = w * chunk;
+				const size_t end = std::min(count, begin + chunk);
+				pool.emplace_back([&, w, begin, end] { workers[w].run(docs, begin, end, out); });
+			}
+			for (auto& t : pool)
+				t.join();
+		}
+
+		// stitching per-worker string data together
+		for (size_t p = 0; p < d_paths.size(); ++p)
+		{
+			auto& col = out[p];
+			if (col.type != ColumnType::String)
+				continue;
+
+			size_t total = 0;
+			for (const auto& w : workers)
+				total += w.d_strBytes[p].size();
+			col.bytes.reserve(total);
+
+			size_t row = 0;
+			for (const auto& w : workers)
+			{
+				for (auto len : w.d_strLens[p])
+				{
+					col.offsets[row + 1] = col.offsets[row] + len;
+					++row;
+				}
+				col.bytes.insert(col.bytes.end(), w.d_strBytes[p].begin(), w.d_strBytes[p].end());
+			}
+		}
+	}
+
+	void run(const std::vector<DocumentView>& docs, std::vector<Column>& out, size_t threads = 1) const
+	{
+		run(docs.empty() ? nullptr : &docs[0], docs.size(), out, threads);
+	}
+};
+} // namespace ebson11
@@ -31,17 +31,214 @@
 #pragma once
 
 #include <vector>
+#include <new>
+#include <utility>
+#include <algorithm>
 #include <cstring>
+#include <cstdint>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define EBSON11_HAVE_MMAP 1
+#endif
 
 namespace ebson11
 {
+/** @brief Tunables for the mmap()-backed storage of large uninit_vector buffers.
+ *
+ * Should be set up before any large buffers are created. The cache limits apply to every
+ * thread separately and cached mappings stay resident, so a pool of N encoding threads may
+ * keep up to N * cacheBytes around, see trim_large_buffers() to give them back earlier.
+ */
+struct LargeBufferConfig
+{
+	size_t threshold = 4 * 1024 * 1024;		// buffers this large and larger are mmap()ed, SIZE_MAX disables
+	bool hugePages = true;					// advise transparent huge pages for them
+	size_t cacheCount = 2;					// freed mappings kept per thread for reuse...
+	size_t cacheBytes = 256 * 1024 * 1024;	// ...as long as they don't exceed this in total
+};
+
+inline LargeBufferConfig& large_buffer_config()
+{
+	static LargeBufferConfig config;
+	return config;
+}
+
 namespace detail
 {
+#ifdef EBSON11_HAVE_MMAP
+	/** @brief Allocates, grows and caches the mappings backing large uninit_vectors.
+	 *
+	 * Growing a mapping uses mremap() on Linux, which moves page table entries instead of
+	 * copying the data. Freed mappings are kept in a small per-thread cache: their pages
+	 * are already faulted in, which is the dominating cost for buffers of this size.
+	 *
+	 * Buffers may outlive the cache of their thread, for instance if they are owned by
+	 * another thread_local object, so once the cache is destroyed they are unmapped right
+	 * away.
+	 */
+	class large_buffers
+	{
+		struct Mapping
+		{
+			void *ptr;
+			size_t bytes;
+		};
+
+		enum State { Unused, Alive, Destroyed };
+
+		std::vector<Mapping> m_cache;
+		size_t m_cachedBytes = 0;
+
+		large_buffers() { state() = Alive; }
+
+		~large_buffers()
+		{
+			state() = Destroyed;
+			for (const auto& m : m_cache)
+				::munmap(m.ptr, m.bytes);
+		}
+
+		// trivially destructible, so it is still valid while the cache itself is destroyed
+		static State& state()
+		{
+			static thread_local State s = Unused;
+			return s;
+		}
+
+		// the cache of the calling thread, or nullptr if it has been destroyed already
+		static large_buffers* local()
+		{
+			if (state() == Destroyed)
+				return nullptr;
+			static thread_local large_buffers cache;
+			return &cache;
+		}
+
+		static size_t round_up(size_t bytes)
+		{
+			static const size_t page = ::sysconf(_SC_PAGESIZE);
+			const size_t unit = large_buffer_config().hugePages ? 2 * 1024 * 1024 : page;
+			return (bytes + unit - 1) / unit * unit;
+		}
+
+		static void advise(void *ptr, size_t bytes)
+		{
+#ifdef MADV_HUGEPAGE
+			if (large_buffer_config().hugePages)
+				::madvise(ptr, bytes, MADV_HUGEPAGE);
+#else
+			(void)ptr;
+			(void)bytes;
+#endif
+		}
+
+		// takes the smallest cached mapping of at least \em bytes, or nullptr
+		void* take_cached(size_t& bytes)
+		{
+			size_t best = m_cache.size();
+			for (size_t i = 0; i < m_cache.size(); ++i)
+				if (m_cache[i].bytes >= bytes && (best == m_cache.size() || m_cache[i].bytes < m_cache[best].bytes))
+					best = i;
+			if (best == m_cache.size())
+				return nullptr;
+
+			const Mapping m = m_cache[best];
+			m_cache.erase(m_cache.begin() + best);
+			m_cachedBytes -= m.bytes;
+			bytes = m.bytes;
+			return m.ptr;
+		}
+	public:
+		/** @brief Unmaps all the mappings cached by the calling thread.
+		 */
+		static void trim()
+		{
+			auto cache = local();
+			if (!cache)
+				return;
+			for (const auto& m : cache->m_cache)
+				::munmap(m.ptr, m.bytes);
+			cache->m_cache.clear();
+			cache->m_cachedBytes = 0;
+		}
+
+		/** @brief Maps at least \em bytes, updating \em bytes to the actual size.
+		 */
+		static void* alloc(size_t& bytes)
+		{
+			bytes = round_up(bytes);
+			auto cache = local();
+			if (void *cached = cache ? cache->take_cached(bytes) : nullptr)
+				return cached;
+
+			void *ptr = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (ptr == MAP_FAILED)
+				throw std::bad_alloc();
+			advise(ptr, bytes);
+			return ptr;
+		}
+
+		/** @brief Grows the mapping \em ptr of \em oldBytes to at least \em bytes keeping
+		 * its first \em used bytes, updates \em bytes to the actual size.
+		 */
+		static void* realloc(void *ptr, size_t oldBytes, size_t used, size_t& bytes)
+		{
+#ifdef __linux__
+			(void)used;
+			bytes = round_up(bytes);
+			void *grown = ::mremap(ptr, oldBytes, bytes, MREMAP_MAYMOVE);
+			if (grown == MAP_FAILED)
+				throw std::bad_alloc();
+			advise(grown, bytes);
+			return grown;
+#else
+			void *grown = alloc(bytes);
+			std::memcpy(grown, ptr, used);
+			free(ptr, oldBytes);
+			return grown;
+#endif
+		}
+
+		static void free(void *ptr, size_t bytes)
+		{
+			const auto& config = large_buffer_config();
+			auto cache = local();
+			if (cache && cache->m_cache.size() < config.cacheCount && cache->m_cachedBytes + bytes <= config.cacheBytes)
+			{
+				cache->m_cache.push_back({ ptr, bytes });
+				cache->m_cachedBytes += bytes;
+			}
+			else
+				::munmap(ptr, bytes);
+		}
+	};
+#endif
+} // namespace detail
+
+/** @brief Returns the large buffer mappings cached by the calling thread to the system.
+ *
+ * Meant for threads which are done with large documents for a while but keep running.
+ */
+inline void trim_large_buffers()
+{
+#ifdef EBSON11_HAVE_MMAP
+	detail::large_buffers::trim();
+#endif
+}
+
+namespace detail
+{
+
 	/** @brief A service class to be used in place of std::vector for performance reasons.
 	 *
 	 * It doesn't initialize vector values (especially on resize()), thus cutting Encoder
 	 * run time roughly in two. It also uses memcpy for copying.
 	 *
+	 * Buffers reaching LargeBufferConfig::threshold bytes move to mmap()ed storage which
+	 * then grows with mremap() and is recycled through a per-thread cache when freed.
+	 *
 	 * @note This vector should be only used with POD types.
 	 *
 	 * @param Alloc Isn't used internally, it is present to keep type signature compatible
@@ -53,11 +250,44 @@ namespace detail
 		T *m_data = nullptr;
 		size_t m_capacity = 0;
 		size_t m_size = 0;
+		bool m_mapped = false;
+
+#ifdef EBSON11_HAVE_MMAP
+		void reserve_mapped(size_t capacity)
+		{
+			size_t bytes = capacity * sizeof(T);
+			void *data;
+			if (m_mapped)
+				data = large_buffers::realloc(m_data, m_capacity * sizeof(T), m_size * sizeof(T), bytes);
+			else
+			{
+				data = large_buffers::alloc(bytes);
+				if (m_data)
+					memcpy(data, m_data, sizeof(T) * m_size);
+				delete [] m_data;
+			}
+
+			m_data = static_cast<T*>(data);
+			m_capacity = bytes / sizeof(T);
+			m_mapped = true;
+		}
+#endif
 	public:
 		typedef uint8_t value_type;
 
 		uninit_vector() {}
-		~uninit_vector() { delete [] m_data; }
+
+		~uninit_vector()
+		{
+#ifdef EBSON11_HAVE_MMAP
+			if (m_mapped)
+			{
+				large_buffers::free(m_data, m_capacity * sizeof(T));
+				return;
+			}
+#endif
+			delete [] m_data;
+		}
 
 		uninit_vector(const uninit_vector<T>& other)
 		{
@@ -71,10 +301,16 @@ namespace detail
 		uninit_vector& operator=(const uninit_vector<T>& other)
 		{
 			reserve(other.m_size);
+			m_size = other.m_size;
 			memcpy(m_data, other.m_data, other.m_size * sizeof(T));
+			return *this;
 		}
 
-		uninit_vector& operator=(uninit_vector<T>&& other) { swap(other); }
+		uninit_vector& operator=(uninit_vector<T>&& other)
+		{
+			swap(other);
+			return *this;
+		}
 
 		const T* begin() const { return m_data; }
 		const T* end() const { return m_data + m_size; }
@@ -84,6 +320,7 @@ namespace detail
 			std::swap(other.m_data, m_data);
 			std::swap(other.m_capacity, m_capacity);
 			std::swap(other.m_size, m_size);
+			std::swap(other.m_mapped, m_mapped);
 		}
 
 		void reserve(size_t capacity)
@@ -91,6 +328,11 @@ namespace detail
 			if (capacity <= m_capacity)
 				return;
 
+#ifdef EBSON11_HAVE_MMAP
+			if (capacity * sizeof(T) >= large_buffer_config().threshold)
+				return reserve_mapped(capacity);
+#endif
+
 			uninit_vector<T> other;
 			other.m_data = new T[capacity];
 			other.m_capacity = capacity;
@@ -104,7 +346,8 @@ namespace detail
 
 		void resize(size_t size)
 		{
-			reserve(size);
+			if (size > m_capacity)
+				reserve(std::max(size, m_capacity * 2));
 			m_size = size;
 		}
 
@@ -121,6 +364,7 @@ namespace detail
 		T& operator[](size_t p) { return m_data[p]; }
 
 		size_t size() const { return m_size; }
+		size_t capacity() const { return m_capacity; }
 
 		std::vector<T> to_std_vector() const
 		{